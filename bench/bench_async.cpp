@@ -0,0 +1,84 @@
+// Measures reading every entry of an archive through the coroutine API with
+// a varying number of reads in flight, and checks that the extraction helper
+// reproduces the entries.
+//
+//   make bench && ./bench/bench_async <image> {directory}
+
+#include <chrono>
+
+#include "async.hpp"
+#include "utils.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static Task<void> read_all(AsyncIO& io, IMGArchive& archive, size_t window, UQWord& bytes) {
+  WaitGroup wg(io);
+
+  for (UDWord id = 0; id < archive.num_files(); id++) {
+    co_await wg.below(window);
+    wg.add();
+    io.spawn([](AsyncIO& io, IMGArchive& archive, UDWord id, WaitGroup& wg, UQWord& bytes) -> Task<void> {
+      File* file = co_await io.read(archive, id);
+      if (file != nullptr)
+        bytes += file->size;
+      DELETE_PTR(file);
+      wg.done();
+    }(io, archive, id, wg, bytes));
+  }
+
+  co_await wg.wait();
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    std::cout << "Usage:\n  " << argv[0] << " <image> {directory}" << std::endl;
+    return FAIL;
+  }
+
+  IMGArchive archive(argv[1], argc == 3 ? argv[2] : "");
+  CHECK((archive.version == vundef), String("Initialization failed for the image: ") + argv[1], FAIL);
+
+  for (size_t window : {1, 16, 256}) {
+    AsyncIO io(window < 32 ? window : 32, window);
+    UQWord  bytes = 0;
+
+    Clock::time_point start = Clock::now();
+    io.spawn(read_all(io, archive, window, bytes));
+    io.run();
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    std::cout << "window " << window << ": " << archive.num_files() << " entries, "
+              << bytes / (1024 * 1024) << " MiB in " << ms << " ms" << std::endl;
+  }
+
+  // The documented usage: extract everything, discarding the result.
+  std::vector<String> names;
+  String              name;
+  UQWord              offset, size;
+  String              dest = (std::filesystem::temp_directory_path() / "gta-img-bench-async").string();
+
+  for (UDWord id = 0; id < archive.num_files(); id++) {
+    archive.get_entry(id, name, offset, size);
+    names.push_back(name);
+  }
+  std::filesystem::create_directories(dest);
+
+  AsyncIO io;
+  io.spawn(extract_async(io, archive, names, dest));
+  io.run();
+
+  UDWord checked = 0;
+  for (UDWord id = 0; id < archive.num_files(); id++) {
+    archive.get_entry(id, name, offset, size);
+    File* file = archive.get_archive_file(id);
+    if (file != nullptr && std::filesystem::file_size(dest + "/" + name) == file->size)
+      checked++;
+    DELETE_PTR(file);
+  }
+  std::filesystem::remove_all(dest);
+
+  std::cout << "extract_async: " << checked << " of " << archive.num_files()
+            << " entries written" << std::endl;
+
+  return checked == archive.num_files() ? SUCCESS : FAIL;
+}
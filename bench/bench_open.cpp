@@ -0,0 +1,99 @@
+// Measures how long opening an archive takes, i.e. loading its header table,
+// for V1 and V2 images with many entries, and how long a small replace takes
+// on an archive that stays open.
+//
+//   make bench && ./bench/bench_open [entries] [iterations]
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "img.hpp"
+#include "utils.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// Writes a V2 image (or a V1 image and .dir) with `count` single-sector entries.
+static void make_image(const String& img_path, const String& dir_path, UDWord count) {
+  std::vector<UByte> table;
+  bool               is_v2 = dir_path.empty();
+  UDWord             first = 0;
+
+  if (is_v2) {
+    first = (IMG_HEADER_SIZE_V2 + count * HEADER_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    table.insert(table.end(), {'V', 'E', 'R', '2'});
+    table.insert(table.end(), reinterpret_cast<UByte*>(&count), reinterpret_cast<UByte*>(&count) + 4);
+  }
+  for (UDWord i = 0; i < count; i++) {
+    HeaderV1 v1 = {first + i, 1, {}};
+    HeaderV2 v2 = {first + i, 1, 0, {}};
+    snprintf(v1.filename, sizeof(v1.filename), "entry%06u.dff", i);
+    memcpy(v2.filename, v1.filename, sizeof(v2.filename));
+
+    UByte* p = is_v2 ? reinterpret_cast<UByte*>(&v2) : reinterpret_cast<UByte*>(&v1);
+    table.insert(table.end(), p, p + HEADER_SIZE);
+  }
+
+  int img = open(img_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int dir = is_v2 ? img : open(dir_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (write(dir, table.data(), table.size()) != (ssize_t)table.size())
+    perror("write");
+  // The entry data is left as a hole, only the tables matter here.
+  if (ftruncate(img, (UQWord)(first + count) * SECTOR_SIZE))
+    perror("ftruncate");
+  if (dir != img)
+    close(dir);
+  close(img);
+}
+
+static double time_open(const String& img_path, const String& dir_path, UDWord iterations) {
+  Clock::time_point start = Clock::now();
+  for (UDWord i = 0; i < iterations; i++) {
+    IMGArchive archive(img_path, dir_path);
+    if (archive.version == vundef)
+      return -1;
+  }
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / iterations;
+}
+
+// Replaces the last entry, so the time is dominated by keeping the table up
+// to date rather than by moving the files behind it.
+static double time_replace(const String& img_path, const String& dir_path, UDWord iterations) {
+  IMGArchive archive(img_path, dir_path);
+  String     name;
+  UQWord     offset, size;
+
+  archive.snapshot_edits = snapshot_off;
+  archive.get_entry(archive.num_files() - 1, name, offset, size);
+
+  Clock::time_point start = Clock::now();
+  for (UDWord i = 0; i < iterations; i++) {
+    std::vector<Replacement> entries(1);
+    entries[0].name = name;
+    entries[0].data.assign(SECTOR_SIZE, (UByte)i);
+    if (archive.replace_archive_entries(entries))
+      return -1;
+  }
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+  UDWord count      = argc > 1 ? std::stoul(argv[1]) : 16000;
+  UDWord iterations = argc > 2 ? std::stoul(argv[2]) : 200;
+  String base       = (std::filesystem::temp_directory_path() / "gta-img-bench").string();
+
+  make_image(base + "-v2.img", "", count);
+  make_image(base + "-v1.img", base + "-v1.dir", count);
+
+  std::cout << "entries: " << count << ", iterations: " << iterations << std::endl;
+  std::cout << "open V1:          " << time_open(base + "-v1.img", base + "-v1.dir", iterations) << " us" << std::endl;
+  std::cout << "open V2:          " << time_open(base + "-v2.img", "", iterations) << " us" << std::endl;
+  std::cout << "replace V1 entry: " << time_replace(base + "-v1.img", base + "-v1.dir", iterations / 10 + 1) << " us" << std::endl;
+  std::cout << "replace V2 entry: " << time_replace(base + "-v2.img", "", iterations / 10 + 1) << " us" << std::endl;
+
+  for (String path : {base + "-v1.img", base + "-v1.dir", base + "-v2.img"})
+    unlink(path.c_str());
+
+  return SUCCESS;
+}
@@ -0,0 +1,181 @@
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "async.hpp"
+#include "utils.hpp"
+
+AsyncIO::AsyncIO(unsigned num_threads, size_t max_inflight) : max_inflight(max_inflight) {
+  if (this->max_inflight == 0)
+    this->max_inflight = 1;
+
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  for (unsigned i = 0; i < std::max(num_threads, 1u); i++)
+    threads.emplace_back(&AsyncIO::work, this);
+}
+
+AsyncIO::~AsyncIO() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+  }
+  wake.notify_all();
+
+  for (std::thread& t : threads)
+    t.join();
+  close(event_fd);
+}
+
+AsyncIO::Detached AsyncIO::run_detached(AsyncIO* io, Task<void> task) {
+  co_await task;
+  io->outstanding--;
+}
+
+void AsyncIO::spawn(Task<void> task) {
+  outstanding++;
+  run_detached(this, std::move(task));
+}
+
+void AsyncIO::post(std::coroutine_handle<> h) {
+  UQWord one = 1;
+  {
+    std::lock_guard<std::mutex> guard(ready_lock);
+    ready.push_back(h);
+  }
+  if (::write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+size_t AsyncIO::poll() {
+  std::deque<std::coroutine_handle<>> batch;
+  UQWord                              count;
+
+  if (::read(event_fd, &count, sizeof(count)) < 0)
+    errno = 0;
+
+  {
+    std::lock_guard<std::mutex> guard(ready_lock);
+    batch.swap(ready);
+  }
+  for (std::coroutine_handle<> h : batch)
+    h.resume();
+
+  return batch.size();
+}
+
+void AsyncIO::run() {
+  struct pollfd pfd = {event_fd, POLLIN, 0};
+
+  while (outstanding) {
+    if (poll() == 0 && outstanding)
+      ::poll(&pfd, 1, -1);
+  }
+}
+
+void AsyncIO::dispatch(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (inflight >= max_inflight) {
+      waiting.push_back(std::move(job));
+      return;
+    }
+    inflight++;
+    jobs.push_back(std::move(job));
+  }
+  wake.notify_one();
+}
+
+void AsyncIO::work() {
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this] { return stop || !jobs.empty(); });
+      if (jobs.empty())
+        return;
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+
+    job();
+
+    // Hand the freed slot straight to the oldest held-back operation.
+    std::lock_guard<std::mutex> guard(lock);
+    if (waiting.empty())
+      inflight--;
+    else {
+      jobs.push_back(std::move(waiting.front()));
+      waiting.pop_front();
+      wake.notify_one();
+    }
+  }
+}
+
+void WaitGroup::done() {
+  count--;
+
+  for (size_t i = 0; i < waiters.size();) {
+    if (count < waiters[i].first) {
+      io.post(waiters[i].second);
+      waiters.erase(waiters.begin() + i);
+    }
+    else
+      i++;
+  }
+}
+
+static Task<void> extract_one(AsyncIO& io, IMGArchive& archive, String filename,
+                              String dest, CancelToken* cancel, WaitGroup& wg, uint& ret) {
+  File* file = nullptr;
+
+  if (!valid_file_name(filename)) {
+    std::cout << "refusing to extract to the path: " << dest << "/" << filename << std::endl;
+    ret = FAIL;
+    wg.done();
+    co_return;
+  }
+
+  file = co_await io.read(archive, filename, cancel);
+  if (file == nullptr) {
+    std::cout << "failed retrieving file: " << filename << std::endl;
+    ret = FAIL;
+  }
+  else {
+    String path  = dest + "/" + filename;
+    bool   wrote = co_await io.offload([file, &path] {
+      FILE* dst = fopen(path.c_str(), "w");
+      if (dst == nullptr)
+        return false;
+      bool ok = fwrite(file->content, sizeof(UByte), file->size, dst) == file->size;
+      return fclose(dst) == 0 && ok;
+    }, cancel);
+
+    if (!wrote) {
+      std::cout << "failed writing file: " << path << std::endl;
+      ret = FAIL;
+    }
+    DELETE_PTR(file);
+  }
+
+  wg.done();
+}
+
+Task<uint> extract_async(AsyncIO& io, IMGArchive& archive, std::vector<String> filenames,
+                         String dest, CancelToken* cancel, size_t window) {
+  WaitGroup wg(io);
+  uint      ret = SUCCESS;
+
+  for (const String& filename : filenames) {
+    // Back-pressure: do not start more entries than the window allows.
+    co_await wg.below(std::max<size_t>(window, 1));
+    if (cancel != nullptr && cancel->cancelled()) {
+      ret = FAIL;
+      break;
+    }
+    wg.add();
+    io.spawn(extract_one(io, archive, filename, dest, cancel, wg, ret));
+  }
+
+  co_await wg.wait();
+  co_return ret;
+}
@@ -0,0 +1,249 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "img.hpp"
+
+/*
+Coroutine front-end for IMGArchive, meant for event-loop based services.
+
+All coroutines run on the thread that calls AsyncIO::run() or AsyncIO::poll()
+(the loop thread). Blocking work such as entry reads and file writes is handed
+to an executor; the awaiting coroutine is resumed on the loop thread once the
+work completes.
+
+Every executor thread performs one blocking pread at a time, so `num_threads`
+is the number of reads actually issued to the device at once; size it to the
+queue depth the storage benefits from. Up to `max_inflight` operations are
+admitted to the executor (those beyond `num_threads` wait in its queue), the
+rest stay suspended until a slot frees up. A single loop can thus have
+hundreds of reads outstanding without unbounded thread or buffer growth.
+
+  AsyncIO io;
+  io.spawn(extract_async(io, archive, names, "out")); // Result discarded
+  io.run();
+
+To use the result of a task, co_await it from another task instead.
+
+Services with their own poll/epoll loop can watch AsyncIO::fd() and call
+poll() whenever it becomes readable instead of blocking in run().
+*/
+
+class AsyncIO;
+
+// Cooperative cancellation flag shared between a caller and its operations.
+// Operations that have not reached the executor yet complete immediately with
+// an empty result, operations already running finish normally.
+class CancelToken {
+  public:
+    void cancel()    { flag = true; }
+    bool cancelled() { return flag; }
+  private:
+    std::atomic<bool> flag{false};
+};
+
+template <typename T> class Task;
+
+template <typename T>
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      if (h.promise().continuation)
+        return h.promise().continuation;
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter        final_suspend()   noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase<T> {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+  Task<void> get_return_object();
+  void return_void() {}
+};
+
+// Lazily started coroutine returning T; it runs once awaited (or spawned).
+template <typename T = void>
+class Task {
+  public:
+    typedef TaskPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    explicit Task(Handle h) : handle(h) {}
+    Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    Task(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+      handle.promise().continuation = caller;
+      return handle;
+    }
+    T await_resume() {
+      if constexpr (!std::is_void_v<T>)
+        return std::move(*handle.promise().value);
+    }
+  private:
+    Handle handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+class AsyncIO {
+  public:
+    AsyncIO(unsigned num_threads = 32, size_t max_inflight = 256);
+    ~AsyncIO();
+
+    // Starts `task` on the calling (loop) thread; run() returns once every
+    // spawned task has finished. The result of a Task<T> is discarded.
+    void   spawn(Task<void> task);
+    template <typename T>
+    void   spawn(Task<T> task) { spawn(discard(std::move(task))); }
+    void   run();
+    size_t poll();
+    int    fd() { return event_fd; }
+
+    // Resumes `h` on the loop thread. Safe to call from any thread.
+    void post(std::coroutine_handle<> h);
+    // Runs `job` on the executor once an in-flight slot is free.
+    void dispatch(std::function<void()> job);
+
+    // Awaitable running `fn` on the executor, resuming with its result.
+    template <typename F>
+    class Offload {
+      public:
+        typedef std::invoke_result_t<F&> Result;
+
+        Offload(AsyncIO& io, F fn, CancelToken* cancel) :
+          io(io), fn(std::move(fn)), cancel(cancel) {}
+
+        bool await_ready() { return cancel != nullptr && cancel->cancelled(); }
+        void await_suspend(std::coroutine_handle<> h) {
+          io.dispatch([this, h] {
+            if (cancel == nullptr || !cancel->cancelled())
+              result = fn();
+            io.post(h);
+          });
+        }
+        Result await_resume() { return std::move(result); }
+      private:
+        AsyncIO&     io;
+        F            fn;
+        CancelToken* cancel;
+        Result       result{};
+    };
+
+    template <typename F>
+    Offload<F> offload(F fn, CancelToken* cancel = nullptr) {
+      return Offload<F>(*this, std::move(fn), cancel);
+    }
+
+    // Reads an entry; resumes with nullptr on failure or cancellation.
+    auto read(IMGArchive& archive, UDWord id, CancelToken* cancel = nullptr) {
+      return offload([&archive, id] { return archive.get_archive_file(id); }, cancel);
+    }
+    auto read(IMGArchive& archive, String filename, CancelToken* cancel = nullptr) {
+      return offload([&archive, filename] { return archive.get_archive_file(filename); },
+                     cancel);
+    }
+  private:
+    struct Detached {
+      struct promise_type {
+        Detached            get_return_object() { return {}; }
+        std::suspend_never  initial_suspend() noexcept { return {}; }
+        std::suspend_never  final_suspend()   noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+      };
+    };
+
+    static Detached run_detached(AsyncIO* io, Task<void> task);
+    template <typename T>
+    static Task<void> discard(Task<T> task) { co_await task; }
+    void work();
+
+    std::vector<std::thread>             threads;
+    std::mutex                           lock;
+    std::condition_variable              wake;
+    std::deque<std::function<void()>>    jobs;    // Handed to the executor
+    std::deque<std::function<void()>>    waiting; // Held back by max_inflight
+    size_t                               inflight = 0;
+    size_t                               max_inflight;
+    bool                                 stop = false;
+
+    std::mutex                           ready_lock;
+    std::deque<std::coroutine_handle<>>  ready;
+    int                                  event_fd;
+    size_t                               outstanding = 0; // Loop thread only
+};
+
+// Counts child tasks spawned by a coroutine. Only touched on the loop thread;
+// waiters are resumed through the loop rather than inline, so a child never
+// runs its parent to completion from inside its own frame.
+class WaitGroup {
+  public:
+    WaitGroup(AsyncIO& io) : io(io) {}
+
+    void   add()   { count++; }
+    void   done();
+    size_t size()  { return count; }
+
+    // Suspends until fewer than `limit` children are outstanding.
+    auto below(size_t limit) {
+      struct Awaiter {
+        WaitGroup& wg;
+        size_t     limit;
+        bool await_ready() { return wg.count < limit; }
+        void await_suspend(std::coroutine_handle<> h) { wg.waiters.push_back({limit, h}); }
+        void await_resume() {}
+      };
+      return Awaiter{*this, limit};
+    }
+    auto wait() { return below(1); }
+  private:
+    AsyncIO& io;
+    size_t   count = 0;
+    std::vector<std::pair<size_t, std::coroutine_handle<>>> waiters;
+};
+
+// Extracts `filenames` from `archive` into the folder `dest` with up to
+// `window` entries in flight. Completes with SUCCESS if every entry was
+// written, FAIL otherwise (including entries skipped by cancellation).
+Task<uint> extract_async(AsyncIO& io, IMGArchive& archive, std::vector<String> filenames,
+                         String dest, CancelToken* cancel = nullptr, size_t window = 256);
+
+#endif
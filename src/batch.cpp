@@ -0,0 +1,170 @@
+#include "batch.hpp"
+#include "pool.hpp"
+#include "utils.hpp"
+
+#define MIN_RANGE_SIZE (4 * 1024 * 1024) // Smallest byte span worth a task
+#define RANGES_PER_THREAD 8
+
+struct BatchArchive {
+  IMGArchive* archive;
+  String      img_path;
+  String      stem;
+  UQWord      img_size;
+};
+
+struct BatchRange {
+  BatchArchive*       img;
+  UDWord              first;
+  UDWord              last;
+  bool                failed = false;
+  std::vector<String> out;
+};
+
+static UQWord fnv1a(const UByte* data, UQWord size) {
+  UQWord h = 0xcbf29ce484222325ULL;
+  for (UQWord i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void run_range(BatchJob job, BatchRange* range, const String& dest) {
+  std::vector<UDWord> ids;
+  String              name;
+  UQWord              offset, size;
+  BatchArchive*       img = range->img;
+
+  for (UDWord id = range->first; id < range->last; id++) {
+    img->archive->get_entry(id, name, offset, size);
+
+    if (offset + size > img->img_size) {
+      range->out.push_back("error: " + img->stem + "/" + name + ": entry extends "
+                           "past the end of the image at offset: " + std::to_string(offset));
+      range->failed = true;
+      continue;
+    }
+
+    // Extraction is batched below to coalesce the reads of the range.
+    if (job == job_extract) {
+      ids.push_back(id);
+      continue;
+    }
+
+    // The archive is shared by all workers; entry reads are positional.
+    File* file = img->archive->get_archive_file(id);
+    if (file == nullptr) {
+      range->out.push_back("error: " + img->stem + "/" + name + ": failed reading "
+                           + std::to_string(size) + " bytes.");
+      range->failed = true;
+      continue;
+    }
+
+    if (job == job_hash) {
+      char hex[17];
+      snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fnv1a(file->content, size));
+      range->out.push_back(String(hex) + "  " + img->stem + "/" + name);
+    }
+
+    DELETE_PTR(file);
+  }
+
+  if (!ids.empty() && img->archive->copy_files_from_img(ids, dest + "/" + img->stem)) {
+    range->out.push_back("error: failed extracting entries " + std::to_string(range->first) +
+                         " to " + std::to_string(range->last - 1) + " of " + img->img_path);
+    range->failed = true;
+  }
+}
+
+uint run_batch(BatchJob job, const std::vector<String>& images, const String& dest) {
+  std::vector<BatchArchive> archives;
+  std::vector<BatchRange>   ranges;
+  UQWord                    total = 0;
+  uint                      ret   = SUCCESS;
+  String                    name;
+  UQWord                    offset, size;
+
+  for (const String& path : images) {
+    std::filesystem::path img_path(path);
+    std::filesystem::path dir_path(img_path);
+    dir_path.replace_extension(".dir");
+
+    IMGArchive* archive = new IMGArchive(path, std::filesystem::exists(dir_path) ?
+                                               dir_path.string() : "");
+    if (archive->version == vundef) {
+      std::cout << "Initialization failed for the image: " << path << std::endl;
+      DELETE_PTR(archive);
+      ret = FAIL;
+      continue;
+    }
+
+    // Entries are extracted to <dest>/<stem>, which has to be unique.
+    String stem = img_path.stem().string();
+    if (job == job_extract && std::any_of(archives.begin(), archives.end(),
+                                          [&stem](const BatchArchive& other) {
+                                            return other.stem == stem;
+                                          })) {
+      std::cout << "error: " << path << ": Another image already extracts to: "
+                << dest + "/" + stem << std::endl;
+      DELETE_PTR(archive);
+      ret = FAIL;
+      continue;
+    }
+
+    BatchArchive img;
+    img.archive  = archive;
+    img.img_path = path;
+    img.stem     = stem;
+    img.img_size = std::filesystem::file_size(img_path);
+    archives.push_back(img);
+    total += img.img_size;
+
+    if (job == job_extract)
+      std::filesystem::create_directories(dest + "/" + img.stem);
+  }
+
+  WorkStealingPool pool;
+  UQWord           range_size = std::max<UQWord>(total / (pool.size() * RANGES_PER_THREAD),
+                                                 MIN_RANGE_SIZE);
+
+  // Cut every archive into consecutive entry ranges of about `range_size`
+  // bytes. The ranges are collected first so their addresses stay stable.
+  for (BatchArchive& img : archives) {
+    UDWord first = 0;
+    UQWord bytes = 0;
+    UDWord count = img.archive->num_files();
+
+    for (UDWord id = 0; id < count; id++) {
+      img.archive->get_entry(id, name, offset, size);
+      bytes += size;
+      if (bytes >= range_size || id + 1 == count) {
+        BatchRange range;
+        range.img   = &img;
+        range.first = first;
+        range.last  = id + 1;
+        ranges.push_back(range);
+        first = id + 1;
+        bytes = 0;
+      }
+    }
+  }
+
+  for (BatchRange& range : ranges)
+    pool.submit([job, &range, &dest] { run_range(job, &range, dest); });
+  pool.wait();
+
+  for (BatchRange& range : ranges) {
+    for (const String& line : range.out)
+      std::cout << line << std::endl;
+    if (range.failed)
+      ret = FAIL;
+  }
+
+  if (job == job_verify && ret == SUCCESS)
+    std::cout << "Verified " << archives.size() << " image(s)." << std::endl;
+
+  for (BatchArchive& img : archives)
+    DELETE_PTR(img.archive);
+
+  return ret;
+}
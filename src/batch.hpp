@@ -0,0 +1,16 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "img.hpp"
+
+enum BatchJob {
+  job_extract, job_verify, job_hash
+};
+
+// Runs `job` over every entry of every image on one work-stealing pool. Each
+// archive is cut into entry ranges of roughly equal byte size so a single
+// large image is spread over all workers. Extracted entries are written to
+// <dest>/<image stem>/<entry name>.
+uint run_batch(BatchJob job, const std::vector<String>& images, const String& dest);
+
+#endif
@@ -1,3 +1,7 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "img.hpp"
 #include "utils.hpp"
 
@@ -7,28 +11,37 @@ void IMGArchive::get_archive_file_v1(UDWord id, File* archive_file) {
   archive_file->size     =  archive_V1[id].filesize * SECTOR_SIZE;
 }
 
+// Loads the whole directory archive with a single read into a table sized up
+// front from the file size.
 uint IMGArchive::open_archive_v1() {
-  size_t ret;
-  UDWord num_entries;
+  struct stat st;
+  UDWord      num_entries;
 
-  FILE* dir = fopen(dir_path.c_str(), "rb"); // open gta3.dir
-  CHECK((dir == NULL), ("Failed opening file: " + dir_path).c_str(), FAIL);
+  use_table(v1);
 
-  std::filesystem::path p{dir_path}; // gta3.dir contains all the headers.
+  int dir = open(dir_path.c_str(), O_RDONLY | O_CLOEXEC); // open gta3.dir
+  CHECK((dir < 0), ("Failed opening file: " + dir_path).c_str(), FAIL);
+
+  if (fstat(dir, &st)) {
+    close(dir);
+    CHECK(true, "Failed reading the size of: " + dir_path, FAIL);
+  }
 
   // Avoid being off by multiple bytes or extra padding when calculating the number of entries.
-  if (std::filesystem::file_size(p) % HEADER_SIZE != 0)
+  if (st.st_size % HEADER_SIZE != 0) {
+    close(dir);
     ERR("Data corruption: All headers in " + dir_path + " are not 32 byte-aligned.");
+  }
 
-  num_entries = std::filesystem::file_size(p) / HEADER_SIZE; // Each header is 32 bytes.
-  for (UDWord i = 0; i < num_entries; i++) {
-    HeaderV1 entry;
-    ret = fread(&entry, 1, HEADER_SIZE, dir);
-    CHECK_FREAD(dir_path, dir, ret, HEADER_SIZE, FAIL);
-    archive_V1.push_back(entry);
+  num_entries = st.st_size / HEADER_SIZE; // Each header is 32 bytes.
+  archive_V1.resize(num_entries);
+  if (pread_full(dir, archive_V1.data(), (size_t)num_entries * HEADER_SIZE, 0)) {
+    close(dir);
+    archive_V1.clear();
+    CHECK(true, dir_path + ": Failed reading " + std::to_string(num_entries) + " headers.", FAIL);
   }
 
-  fclose(dir);
+  close(dir);
   version = v1;
   return SUCCESS;
 }
@@ -47,21 +60,27 @@ bool IMGArchive::write_to_archive_v1(File* file, UDWord id) {
   if (file->size % SECTOR_SIZE)
     ERR(String(header->filename) + ": The file size must be 2048 byte aligned");
 
-  // Write to .dir:
-  FILE* dir = fopen(dir_path.c_str(), "r+");
-  CHECK((dir == nullptr), (String("failed opening directory: ") + dir_path), FAIL);
-  // Write 32 bytes from the offset: id * HEADER_SIZE
-  fseek(dir, id * HEADER_SIZE, SEEK_SET);
-  ret = fwrite(header, sizeof(HeaderV1), 1, dir);
-  CHECK_FWRITE(dir_path, dir, ret, 1, FAIL);
-  fclose(dir);
+  // Write to .dir, unless the header did not change:
+  if (memcmp(header, &archive_V1[id], sizeof(HeaderV1))) {
+    if (snapshot_before_write())
+      return FAIL;
+    FILE* dir = fopen(dir_path.c_str(), "r+");
+    CHECK((dir == nullptr), (String("failed opening directory: ") + dir_path), FAIL);
+    // Write 32 bytes from the offset: id * HEADER_SIZE
+    fseek(dir, id * HEADER_SIZE, SEEK_SET);
+    ret = fwrite(header, sizeof(HeaderV1), 1, dir);
+    CHECK_FWRITE(dir_path, dir, ret, 1, FAIL);
+    fclose(dir);
+  }
 
   // Write to .img:
   FILE* img = fopen(img_path.c_str(), "r+");
   CHECK((img == nullptr), (String("failed opening image: ") + img_path), FAIL);
-  fseek(img, file->offset, SEEK_SET);
-  ret = fwrite(file->content, sizeof(UByte), file->size, img);
-  CHECK_FWRITE(img_path, img, ret, file->size, FAIL);
+  if (write_entry(img, file, (UQWord)archive_V1[id].offset   * SECTOR_SIZE,
+                             (UQWord)archive_V1[id].filesize * SECTOR_SIZE)) {
+    fclose(img);
+    ERR("Failed writing " + String(header->filename) + " to: " + img_path);
+  }
   fclose(img);
 
   DELETE_PTR(header);
@@ -69,93 +88,131 @@ bool IMGArchive::write_to_archive_v1(File* file, UDWord id) {
   return SUCCESS;
 }
 
-static inline
-void pad_null_bytes(UByte* arr, UDWord arr_size, UDWord pad_len) {
-  for (UDWord i = arr_size-pad_len; i < arr_size; i++)
-    arr[i] = 0x0;
-}
-
-bool IMGArchive::replace_archive_files_v1(std::vector<String>  old_files,
-                                          std::vector<String>  new_files) {
+bool IMGArchive::replace_archive_files_v1(std::vector<Replacement>& entries) {
   UDWord file_idx;
-  std::vector<Files<String, UDWord>> files_idxs;
-
-  if (old_files.size() != new_files.size())
-    ERR("There is an inequivalent amount of old and new files to be replaced.");
+  std::vector<Files<Replacement*, UDWord>> files_idxs;
 
   // Sort the files that are going to get replaced by their ID, to keep the
   // file order in the archive intact.
-  for (UDWord i = 0; i < old_files.size(); i++) {
+  for (Replacement& entry : entries) {
 
-    file_idx = get_file_idx<HeaderV1>(archive_V1, old_files[i]);
+    file_idx = get_file_idx<HeaderV1>(archive_V1, entry.name);
     CHECK((file_idx == archive_V1.size()),
-      "Failed to find the replaceable file: " + old_files[i] +
+      "Failed to find the replaceable file: " + entry.name +
       " in the archive: " + img_path, FAIL);
 
-    if (!std::filesystem::exists(new_files[i]))
-      ERR("The replacing file does not exist: " + new_files[i]);
-
-    files_idxs.push_back(Files(new_files[i], file_idx));
+    files_idxs.push_back(Files(&entry, file_idx));
   }
 
   std::sort(files_idxs.begin(), files_idxs.end(),
-    [](const Files<String, UDWord> &x,
-       const Files<String, UDWord> &y) {
+    [](const Files<Replacement*, UDWord> &x,
+       const Files<Replacement*, UDWord> &y) {
       return x.idx < y.idx;
     });
 
-  std::vector<File*>  archive;
-  std::vector<UDWord> idxs;
+  // Lay the files out back to back from the one in front of the first
+  // replaced file, from the table and the sizes of the replacements alone.
+  UDWord                    first = (files_idxs[0].idx ? files_idxs[0].idx - 1 : 0);
+  UDWord                    count = entry_count() - first;
+  std::vector<Replacement*> replacements(count, nullptr);
+  std::vector<UQWord>       from, sizes, to;
+
+  for (Files<Replacement*, UDWord>& file : files_idxs)
+    replacements[file.idx - first] = file.path;
+
+  for (UDWord k = 0; k < count; k++) {
+    from.push_back((UQWord)archive_V1[first + k].offset   * SECTOR_SIZE);
+    sizes.push_back((UQWord)archive_V1[first + k].filesize * SECTOR_SIZE);
+    to.push_back(k ? to[k-1] + (replacements[k-1] ? replacements[k-1]->padded_size() : sizes[k-1])
+                   : from[0]);
+  }
 
-  UDWord pad_size, remainder;
-  UDWord i = (files_idxs[0].idx ? files_idxs[0].idx - 1 : 0);
+  // Only files that move are read, each right before it is written, unless
+  // the files are stored out of order. Then all of them are read up front.
+  std::vector<UDWord> order = move_order(from, sizes, to);
+  std::vector<File*>  moved(count, nullptr);
+
+  if (order.empty()) {
+    for (UDWord k = 0; k < count; k++) {
+      order.push_back(k);
+      if (replacements[k] || to[k] == from[k])
+        continue;
+      moved[k] = read_archive_file(first + k);
+      if (moved[k] == nullptr) {
+        DELETE_VEC(moved);
+        ERR("Failed to retrieve file from the archive.");
+      }
+    }
+  }
 
-  // Replace the files by their ID in sorted order:
-  for (UDWord j = 0; i < num_files(); i++) {
-    File* file = new File;
-    pad_size   = 0;
+  bool ret = SUCCESS;
+  for (UDWord k : order) {
+    UDWord i    = first + k;
+    File*  file = moved[k];
+
+    // Untouched files that did not move are already in place.
+    if (!replacements[k] && to[k] == from[k])
+      continue;
+
+    if (replacements[k]) {
+      file = new File;
+      if (load_replacement(*replacements[k], file)) {
+        DELETE_PTR(file);
+        ret = FAIL;
+        break;
+      }
+    }
+    else if (file == nullptr && (file = read_archive_file(i)) == nullptr) {
+      std::cout << "Failed to retrieve file from the archive." << std::endl;
+      ret = FAIL;
+      break;
+    }
+    moved[k]     = nullptr;
+    file->offset = to[k];
+
+    if (write_to_archive_v1(file, i)) {
+      DELETE_PTR(file);
+      std::cout << "error: Failed writing to archive." << std::endl;
+      ret = FAIL;
+      break;
+    }
 
-    if (i == files_idxs[j].idx) {
-      file->offset  = archive_V1[i].offset * SECTOR_SIZE;
-      file->size    = std::filesystem::file_size(files_idxs[j].path);
+    // Keep the table in step with what is on disk instead of reparsing it.
+    archive_V1[i].offset   = file->offset / SECTOR_SIZE;
+    archive_V1[i].filesize = file->size   / SECTOR_SIZE;
+    DELETE_PTR(file);
+  }
 
-      remainder = file->size % SECTOR_SIZE;
-      // Pad sufficient futile null-byte sleds to the file and update its size
-      if (remainder)
-        pad_size = SECTOR_SIZE - remainder;
+  files_idxs.clear();
+  DELETE_VEC(moved);
 
-      file->content = new UByte[file->size + pad_size];
-      pad_null_bytes(file->content, file->size + pad_size, pad_size);
-      if (read_from_file(files_idxs[j].path.c_str(), 0, file->content, file->size))
-        return FAIL;
-      file->size += pad_size;
+  return ret;
+}
 
-      j++;
-    }
-    else
-      file = get_archive_file(i);
+// Appends `entries` behind the last file of the image and their headers to the
+// end of the directory archive.
+bool IMGArchive::add_archive_files_v1(std::vector<Replacement>& entries) {
+  UQWord end = 0;
 
-    CHECK((file == nullptr), "Failed to retrieve file from the archive.", FAIL);
-    idxs.push_back(i);
-    archive.push_back(file);
-  }
+  for (HeaderV1& header : archive_V1)
+    end = std::max<UQWord>(end, (UQWord)(header.offset + header.filesize) * SECTOR_SIZE);
 
-  // Rectify and align offsets:
-  for (i = 0; i < archive.size(); i++) {
-    if (i)
-      archive[i]->offset = archive[i-1]->offset + archive[i-1]->size;
+  for (Replacement& entry : entries) {
+    HeaderV1 header = {};
+    strncpy(header.filename, entry.name.c_str(), 23);
+    archive_V1.push_back(header);
 
-    if(write_to_archive_v1(archive[i], idxs[i]))
-      ERR("Failed writing to archive.");
+    File* file   = new File;
+    file->offset = end;
+    if (load_replacement(entry, file) || write_to_archive_v1(file, archive_V1.size() - 1)) {
+      DELETE_PTR(file);
+      ERR("Failed adding " + entry.name + " to the archive.");
+    }
+    archive_V1.back().offset   = file->offset / SECTOR_SIZE;
+    archive_V1.back().filesize = file->size   / SECTOR_SIZE;
+    end += file->size;
+    DELETE_PTR(file);
   }
 
-  files_idxs.clear();
-  idxs.clear();
-  DELETE_VEC(archive);
-  archive_V1.clear();
-
-  // Re-open the new archive.
-  open_archive();
-
-  return 0;
+  return SUCCESS;
 }
@@ -1,3 +1,5 @@
+#include <sys/stat.h>
+
 #include "img.hpp"
 #include "utils.hpp"
 
@@ -7,27 +9,41 @@ void IMGArchive::get_archive_file_v2(UDWord id, File* archive_file) {
   archive_file->size     =  archive_V2[id].streamsize * SECTOR_SIZE;
 }
 
+// Loads the header table with a single read into a table sized up front from
+// the file count, once the count is known to fit into the image. Headers are
+// validated when their entry is read, not here.
 uint IMGArchive::open_archive_v2() {
-  size_t ret;
-  UDWord num_entries;
+  struct stat st;
+  UDWord      num_entries;
+
+  use_table(v2);
+
+  CHECK(pread_full(img_fd, &num_entries, sizeof(UDWord), 4),
+        img_path + ": Failed reading the number of files.", FAIL);
+  CHECK(fstat(img_fd, &st), "Failed reading the size of: " + img_path, FAIL);
+
+  // A corrupt count must not size the table past what the image can hold.
+  CHECK((IMG_HEADER_SIZE_V2 + (UQWord)num_entries * HEADER_SIZE > (UQWord)st.st_size),
+        img_path + ": Data corruption: " + std::to_string(num_entries) +
+        " headers do not fit into the image.", FAIL);
 
-  ret     = fread(&num_entries, sizeof(UDWord), 1, img);
-  CHECK_FREAD(img_path, img, ret, 1, FAIL);
-
-  for (UDWord i = 0; i < num_entries; i++) {
-    HeaderV2 entry;
-    ret = fread(&entry, sizeof(UByte), HEADER_SIZE, img);
-    CHECK_FREAD(img_path, img, ret, HEADER_SIZE, FAIL);
-    if (entry.filesize != 0)
-      ERR("[" + std::to_string(i) + "] DATA CORRUPTION: filesize should be 0, "
-           "but is instead: " + std::to_string(entry.filesize) + "\n");
-    archive_V2.push_back(entry);
+  archive_V2.resize(num_entries);
+  if (pread_full(img_fd, archive_V2.data(), (size_t)num_entries * HEADER_SIZE, IMG_HEADER_SIZE_V2)) {
+    archive_V2.clear();
+    CHECK(true, img_path + ": Failed reading " + std::to_string(num_entries) + " headers.", FAIL);
   }
 
   version = v2;
   return SUCCESS;
 }
 
+bool IMGArchive::validate_entry_v2(UDWord id) {
+  if (archive_V2[id].filesize != 0)
+    ERR("[" + std::to_string(id) + "] DATA CORRUPTION: filesize should be 0, "
+         "but is instead: " + std::to_string(archive_V2[id].filesize) + "\n");
+  return SUCCESS;
+}
+
 bool IMGArchive::write_to_archive_v2(File* file, UDWord id) {
   size_t ret;
   size_t header_section;
@@ -40,7 +56,7 @@ bool IMGArchive::write_to_archive_v2(File* file, UDWord id) {
   strncpy(header->filename, archive_V2[id].filename, 24);
   header->filename[23] = '\0';
 
-  header_section  = IMG_HEADER_SIZE_V2 + num_files()*HEADER_SIZE;
+  header_section  = IMG_HEADER_SIZE_V2 + entry_count()*HEADER_SIZE;
 
   if (file->size % SECTOR_SIZE)
     ERR(String(header->filename) + ": The file size must be 2048 byte aligned.");
@@ -51,13 +67,21 @@ bool IMGArchive::write_to_archive_v2(File* file, UDWord id) {
   FILE* img = fopen(img_path.c_str(), "r+");
   CHECK((img == nullptr), (String("failed opening image: ") + img_path), FAIL);
 
-  // Write to .img:
-  fseek(img, IMG_HEADER_SIZE_V2 + id*HEADER_SIZE, SEEK_SET);
-  ret = fwrite(header, sizeof(HeaderV2), 1, img);
-  CHECK_FWRITE(img_path, img, ret, 1, FAIL);
-  fseek(img, file->offset, SEEK_SET);
-  ret = fwrite(file->content, sizeof(UByte), file->size, img);
-  CHECK_FWRITE(img_path, img, ret, file->size, FAIL);
+  // Write to .img, the header only if it changed:
+  if (memcmp(header, &archive_V2[id], sizeof(HeaderV2))) {
+    if (snapshot_before_write()) {
+      fclose(img);
+      return FAIL;
+    }
+    fseek(img, IMG_HEADER_SIZE_V2 + id*HEADER_SIZE, SEEK_SET);
+    ret = fwrite(header, sizeof(HeaderV2), 1, img);
+    CHECK_FWRITE(img_path, img, ret, 1, FAIL);
+  }
+  if (write_entry(img, file, (UQWord)archive_V2[id].offset     * SECTOR_SIZE,
+                             (UQWord)archive_V2[id].streamsize * SECTOR_SIZE)) {
+    fclose(img);
+    ERR("Failed writing " + String(header->filename) + " to: " + img_path);
+  }
 
   fclose(img);
   DELETE_PTR(header);
@@ -65,93 +89,168 @@ bool IMGArchive::write_to_archive_v2(File* file, UDWord id) {
   return SUCCESS;
 }
 
-static inline
-void pad_null_bytes(UByte* arr, UDWord arr_size, UDWord pad_len) {
-  for (UDWord i = arr_size-pad_len; i < arr_size; i++)
-    arr[i] = 0x0;
-}
-
-bool IMGArchive::replace_archive_files_v2(std::vector<String>  old_files,
-                                          std::vector<String>  new_files) {
+bool IMGArchive::replace_archive_files_v2(std::vector<Replacement>& entries) {
   UDWord file_idx;
-  std::vector<Files<String, UDWord>> files_idxs;
-
-  if (old_files.size() != new_files.size())
-    ERR("There is an inequivalent amount of old and new files to be replaced.");
+  std::vector<Files<Replacement*, UDWord>> files_idxs;
 
   // Sort the files that are going to get replaced by their ID, to keep the
   // file order in the archive intact.
-  for (UDWord i = 0; i < old_files.size(); i++) {
+  for (Replacement& entry : entries) {
 
-    file_idx = get_file_idx<HeaderV2>(archive_V2, old_files[i]);
+    file_idx = get_file_idx<HeaderV2>(archive_V2, entry.name);
     CHECK((file_idx == archive_V2.size()),
-      "Failed to find the replaceable file: " + old_files[i] +
+      "Failed to find the replaceable file: " + entry.name +
       " in the archive: " + img_path, FAIL);
 
-    if (!std::filesystem::exists(new_files[i]))
-      ERR("The replacing file does not exist: " + new_files[i]);
-
-    files_idxs.push_back(Files(new_files[i], file_idx));
+    files_idxs.push_back(Files(&entry, file_idx));
   }
 
   std::sort(files_idxs.begin(), files_idxs.end(),
-    [](const Files<String, UDWord> &x,
-       const Files<String, UDWord> &y) {
+    [](const Files<Replacement*, UDWord> &x,
+       const Files<Replacement*, UDWord> &y) {
       return x.idx < y.idx;
     });
 
-  std::vector<File*>  archive;
-  std::vector<UDWord> idxs;
+  // Lay the files out back to back from the one in front of the first
+  // replaced file, from the table and the sizes of the replacements alone.
+  UDWord                    first = (files_idxs[0].idx ? files_idxs[0].idx - 1 : 0);
+  UDWord                    count = entry_count() - first;
+  std::vector<Replacement*> replacements(count, nullptr);
+  std::vector<UQWord>       from, sizes, to;
+
+  for (Files<Replacement*, UDWord>& file : files_idxs)
+    replacements[file.idx - first] = file.path;
+
+  for (UDWord k = 0; k < count; k++) {
+    from.push_back((UQWord)archive_V2[first + k].offset     * SECTOR_SIZE);
+    sizes.push_back((UQWord)archive_V2[first + k].streamsize * SECTOR_SIZE);
+    to.push_back(k ? to[k-1] + (replacements[k-1] ? replacements[k-1]->padded_size() : sizes[k-1])
+                   : from[0]);
+  }
+
+  // Only files that move are read, each right before it is written, unless
+  // the files are stored out of order. Then all of them are read up front.
+  std::vector<UDWord> order = move_order(from, sizes, to);
+  std::vector<File*>  moved(count, nullptr);
+
+  if (order.empty()) {
+    for (UDWord k = 0; k < count; k++) {
+      order.push_back(k);
+      if (replacements[k] || to[k] == from[k])
+        continue;
+      moved[k] = read_archive_file(first + k);
+      if (moved[k] == nullptr) {
+        DELETE_VEC(moved);
+        ERR("Failed to retrieve file from the archive.");
+      }
+    }
+  }
+
+  bool ret = SUCCESS;
+  for (UDWord k : order) {
+    UDWord i    = first + k;
+    File*  file = moved[k];
+
+    // Untouched files that did not move are already in place.
+    if (!replacements[k] && to[k] == from[k])
+      continue;
+
+    if (replacements[k]) {
+      file = new File;
+      if (load_replacement(*replacements[k], file)) {
+        DELETE_PTR(file);
+        ret = FAIL;
+        break;
+      }
+    }
+    else if (file == nullptr && (file = read_archive_file(i)) == nullptr) {
+      std::cout << "Failed to retrieve file from the archive." << std::endl;
+      ret = FAIL;
+      break;
+    }
+    moved[k]     = nullptr;
+    file->offset = to[k];
+
+    if (write_to_archive_v2(file, i)) {
+      DELETE_PTR(file);
+      std::cout << "error: Failed writing to archive." << std::endl;
+      ret = FAIL;
+      break;
+    }
+
+    // Keep the table in step with what is on disk instead of reparsing it.
+    archive_V2[i].offset     = file->offset / SECTOR_SIZE;
+    archive_V2[i].streamsize = file->size   / SECTOR_SIZE;
+    archive_V2[i].filesize   = 0;
+    DELETE_PTR(file);
+  }
 
-  UDWord pad_size, remainder;
-  UDWord i = (files_idxs[0].idx ? files_idxs[0].idx - 1 : 0);
+  files_idxs.clear();
+  DELETE_VEC(moved);
 
-  // Replace the files by their ID in sorted order:
-  for (UDWord j = 0; i < num_files(); i++) {
-    File* file = new File;
-    pad_size   = 0;
+  return ret;
+}
 
-    if (i == files_idxs[j].idx) {
-      file->offset  = archive_V2[i].offset * SECTOR_SIZE;
-      file->size    = std::filesystem::file_size(files_idxs[j].path);
+// Checks that the header section can take `count` more headers without
+// running into the first file. Replacing files never moves the first file, so
+// this holds before and after a replace.
+bool IMGArchive::check_header_room_v2(UDWord count) {
+  UQWord first = UINT64_MAX;
 
-      remainder = file->size % SECTOR_SIZE;
-      // Pad sufficient futile null-byte sleds to the file and update its size
-      if (remainder)
-        pad_size = SECTOR_SIZE - remainder;
+  for (HeaderV2& header : archive_V2)
+    first = std::min<UQWord>(first, (UQWord)header.offset * SECTOR_SIZE);
 
-      file->content = new UByte[file->size + pad_size];
-      pad_null_bytes(file->content, file->size + pad_size, pad_size);
-      if (read_from_file(files_idxs[j].path.c_str(), 0, file->content, file->size))
-        return FAIL;
-      file->size += pad_size;
+  if (IMG_HEADER_SIZE_V2 + ((UQWord)archive_V2.size() + count) * HEADER_SIZE > first)
+    ERR("No room left in the header section of " + img_path + " for " +
+        std::to_string(count) + " more header(s).");
 
-      j++;
-    }
-    else
-      file = get_archive_file(i);
+  return SUCCESS;
+}
 
-    CHECK((file == nullptr), "Failed to retrieve file from the archive.", FAIL);
-    idxs.push_back(i);
-    archive.push_back(file);
-  }
+// Appends `entries` behind the last file of the image. Their headers extend
+// the header section in place, which only works while there is unused space
+// in front of the first file.
+bool IMGArchive::add_archive_files_v2(std::vector<Replacement>& entries) {
+  size_t ret;
+  UQWord end = 0;
+  UQWord header_section;
+  UDWord num_entries;
 
-  // Rectify and align offsets:
-  for (i = 0; i < archive.size(); i++) {
-    if (i)
-      archive[i]->offset = archive[i-1]->offset + archive[i-1]->size;
+  if (check_header_room_v2(entries.size()))
+    return FAIL;
 
-    if(write_to_archive_v2(archive[i], idxs[i]))
-      ERR("Failed writing to archive.");
-  }
+  for (HeaderV2& header : archive_V2)
+    end = std::max<UQWord>(end, (UQWord)(header.offset + header.streamsize) * SECTOR_SIZE);
 
-  files_idxs.clear();
-  idxs.clear();
-  DELETE_VEC(archive);
-  archive_V2.clear();
+  num_entries    = archive_V2.size() + entries.size();
+  header_section = IMG_HEADER_SIZE_V2 + (UQWord)num_entries * HEADER_SIZE;
+  // An empty image has no files to bound the header section, keep it clear.
+  end = std::max<UQWord>(end, (header_section + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE);
+
+  for (Replacement& entry : entries) {
+    HeaderV2 header = {};
+    strncpy(header.filename, entry.name.c_str(), 23);
+    archive_V2.push_back(header);
 
-  // Re-open the new archive.
-  open_archive();
+    File* file   = new File;
+    file->offset = end;
+    if (load_replacement(entry, file) || write_to_archive_v2(file, archive_V2.size() - 1)) {
+      DELETE_PTR(file);
+      ERR("Failed adding " + entry.name + " to the archive.");
+    }
+    archive_V2.back().offset     = file->offset / SECTOR_SIZE;
+    archive_V2.back().streamsize = file->size   / SECTOR_SIZE;
+    end += file->size;
+    DELETE_PTR(file);
+  }
 
-  return 0;
+  // Update the number of files in the image header.
+  FILE* img = fopen(img_path.c_str(), "r+");
+  CHECK((img == nullptr), (String("failed opening image: ") + img_path), FAIL);
+  fseek(img, 4, SEEK_SET);
+  ret = fwrite(&num_entries, sizeof(UDWord), 1, img);
+  CHECK_FWRITE(img_path, img, ret, 1, FAIL);
+  fclose(img);
+
+  return SUCCESS;
 }
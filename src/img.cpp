@@ -1,32 +1,55 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_map>
+
 #include "img.hpp"
 #include "utils.hpp"
+#include "snapshot.hpp"
 
 IMGArchive::IMGArchive(String path1, String path2) {
-  img      = nullptr;
   img_path = path1;
   dir_path = path2;
   open_archive();
 }
 
 IMGArchive::~IMGArchive() {
-  if      (version == v1) archive_V1.clear();
-  else if (version == v2) archive_V2.clear();
-  else if (version == v3) archive_V3.clear();
+  if (img_fd >= 0)
+    close(img_fd);
+
+  if      (table == v2) archive_V2.~vector();
+  else if (table == v3) archive_V3.~vector();
+  else                  archive_V1.~vector();
+}
+
+// Makes the header table of `v` the live member of the table union, destroying
+// the previously live one.
+void IMGArchive::use_table(Version v) {
+  if (v == table)
+    return;
+
+  if      (table == v2) archive_V2.~vector();
+  else if (table == v3) archive_V3.~vector();
+  else                  archive_V1.~vector();
+
+  if      (v == v2) new (&archive_V2) std::vector<HeaderV2>();
+  else if (v == v3) new (&archive_V3) std::vector<HeaderV3>();
+  else              new (&archive_V1) std::vector<HeaderV1>();
+  table = v;
 }
 
 File::~File() {
-  delete content;
+  delete[] content;
   content = nullptr;
 }
 
 uint IMGArchive::open_archive() {
-  size_t ret;
-  img = fopen(&img_path[0], "rb");
-  CHECK((img == nullptr), ("Failed opening file: " + img_path).c_str(), FAIL);
+  if (img_fd >= 0)
+    close(img_fd);
+  img_fd = open(img_path.c_str(), O_RDONLY | O_CLOEXEC);
+  CHECK((img_fd < 0), ("Failed opening file: " + img_path).c_str(), FAIL);
 
   char ver[4];
-  ret = fread(ver, sizeof(char), 4, img);
-  CHECK_FREAD(img_path, img, ret, 4, FAIL);
+  CHECK(pread_full(img_fd, ver, 4, 0), img_path + ": Failed reading the image header.", FAIL);
 
   if (ver[0] == 'V' && ver[1] == 'E' && ver[2] == 'R' && ver[3] == '2') {
     CHECK(open_archive_v2(),  "Failed opening V2 archive " + img_path, FAIL); }
@@ -35,25 +58,27 @@ uint IMGArchive::open_archive() {
   else {
     CHECK(open_archive_v1(), "Failed opening V1 archive: " + img_path, FAIL); }
 
-  fclose(img);
   return 0;
 }
 
 UDWord IMGArchive::num_files() {
+  std::shared_lock<std::shared_mutex> guard(table_lock);
+  return entry_count();
+}
+
+UDWord IMGArchive::entry_count() {
   if      (version == vundef) return 0;
   else if (version == v1)     return archive_V1.size();
   return archive_V2.size();
 }
 
-File* IMGArchive::get_archive_file(UDWord id) {
-  size_t ret;
-
-  if (id >= num_files() || version == vundef)
+// Reads entry `id` with the table lock already held by the caller.
+File* IMGArchive::read_archive_file(UDWord id) {
+  if (id >= entry_count() || version == vundef)
     return nullptr;
 
-  img = nullptr;
-  img = fopen(&img_path[0], "rb");
-  CHECK((img == nullptr), ("Failed opening file: " + img_path).c_str(), nullptr)
+  if (version == v2 && validate_entry_v2(id))
+    return nullptr;
 
   File* archive_file = new File;
   if (version == v1)
@@ -63,51 +88,65 @@ File* IMGArchive::get_archive_file(UDWord id) {
 
   archive_file->content = new UByte[archive_file->size];
 
-  fseek(img, archive_file->offset, SEEK_SET);
-  ret = fread(archive_file->content, sizeof(char), archive_file->size, img);
-  CHECK_FREAD(img_path, img, ret, archive_file->size, nullptr);
-  fclose(img);
+  if (pread_full(img_fd, archive_file->content, archive_file->size, archive_file->offset)) {
+    std::cout << img_path << ": Failed reading " << archive_file->size
+              << " bytes at offset: " << archive_file->offset << std::endl;
+    DELETE_PTR(archive_file);
+    return nullptr;
+  }
 
   return archive_file;
 }
 
+File* IMGArchive::get_archive_file(UDWord id) {
+  std::shared_lock<std::shared_mutex> guard(table_lock);
+  return read_archive_file(id);
+}
+
 File* IMGArchive::get_archive_file(String filename) {
-  size_t ret;
-  String entry_filename;
+  std::shared_lock<std::shared_mutex> guard(table_lock);
 
-  UDWord num_entries = num_files();
+  if (version == v1)
+    return read_archive_file(get_file_idx<HeaderV1>(archive_V1, filename));
+  else if (version == v2)
+    return read_archive_file(get_file_idx<HeaderV2>(archive_V2, filename));
+  else if (version == v3)
+    std::cout << "get_archive_file: Unimplemented code" << std::endl;
 
-  for (UDWord i = 0; i < num_entries; i++) {
-    if (version == v1)
-      entry_filename = archive_V1[i].filename;
-    else if (version == v2)
-      entry_filename = archive_V2[i].filename;
-    else
-      std::cout << "get_archive_file: Unimplemented code" << std::endl;
+  return nullptr;
+}
 
-    if (entry_filename == filename) {
-      img = nullptr;
-      img = fopen(&img_path[0], "rb");
-      CHECK((img == nullptr), ("Failed opening file: " + img_path).c_str(), nullptr);
+// Looks up the name and byte extent of an entry without touching the image.
+bool IMGArchive::get_entry(UDWord id, String& filename, UQWord& offset, UQWord& size) {
+  std::shared_lock<std::shared_mutex> guard(table_lock);
 
-      File* archive_file = new File;
-      if (version == v1)
-        get_archive_file_v1(i, archive_file);
-      else
-        get_archive_file_v2(i, archive_file);
+  if (id >= entry_count() || version == vundef)
+    return FAIL;
 
-      archive_file->content = new UByte[archive_file->size];
+  File entry;
+  entry.content = nullptr;
+  if (version == v1) {
+    get_archive_file_v1(id, &entry);
+    filename = String(entry.headerV1->filename, strnlen(entry.headerV1->filename, 24));
+  }
+  else {
+    get_archive_file_v2(id, &entry);
+    filename = String(entry.headerV2->filename, strnlen(entry.headerV2->filename, 24));
+  }
+  offset = entry.offset;
+  size   = entry.size;
 
-      fseek(img, archive_file->offset, SEEK_SET);
-      ret = fread(archive_file->content, sizeof(char), archive_file->size, img);
-      CHECK_FREAD(img_path, img, ret, archive_file->size, nullptr);
-      fclose(img);
+  return SUCCESS;
+}
 
-      return archive_file;
-    }
-  }
+bool IMGArchive::contains(String filename) {
+  std::shared_lock<std::shared_mutex> guard(table_lock);
 
-  return nullptr;
+  if (version == v1)
+    return get_file_idx<HeaderV1>(archive_V1, filename) != archive_V1.size();
+  else if (version == v2)
+    return get_file_idx<HeaderV2>(archive_V2, filename) != archive_V2.size();
+  return false;
 }
 
 uint IMGArchive::copy_file_from_img(String filename, String dest) {
@@ -126,6 +165,142 @@ uint IMGArchive::copy_file_from_img(String filename, String dest) {
   return 0;
 }
 
+// Extracts `filenames` into the folder `dest`. A name stored more than once
+// refers to its first entry.
+uint IMGArchive::copy_files_from_img(std::vector<String> filenames, String dest, UQWord gap) {
+  std::unordered_map<String, UDWord> index;
+  std::vector<UDWord>                ids;
+  uint                               ret = SUCCESS;
+
+  std::shared_lock<std::shared_mutex> guard(table_lock);
+
+  for (UDWord id = 0; id < entry_count(); id++) {
+    const char* name = (version == v1) ? archive_V1[id].filename : archive_V2[id].filename;
+    index.emplace(String(name, strnlen(name, 24)), id);
+  }
+
+  for (const String& filename : filenames) {
+    auto it = index.find(filename);
+    if (it == index.end()) {
+      std::cerr << "failed retrieving file: " << filename << std::endl;
+      ret = FAIL;
+      continue;
+    }
+    ids.push_back(it->second);
+  }
+
+  return copy_entries(ids, dest, gap) || ret;
+}
+
+// Extracts the entries `ids` into the folder `dest`.
+uint IMGArchive::copy_files_from_img(std::vector<UDWord> ids, String dest, UQWord gap) {
+  std::shared_lock<std::shared_mutex> guard(table_lock);
+  return copy_entries(ids, dest, gap);
+}
+
+// The entries are sorted by offset and neighbours no more than `gap` bytes
+// apart are merged into one read of up to COALESCE_MAX_RUN bytes, so a batch
+// of files stored next to each other is read sequentially. The next run is
+// announced to the kernel with posix_fadvise while the current one is written
+// out. Entries whose names are not plain file names are refused.
+uint IMGArchive::copy_entries(std::vector<UDWord>& ids, String& dest, UQWord gap) {
+  struct Extent {
+    String name;
+    UQWord offset;
+    UQWord size;
+  };
+  struct Run {
+    size_t first, last; // Extents [first, last)
+    UQWord offset, size;
+  };
+
+  std::vector<Extent> extents;
+  std::vector<Run>    runs;
+  std::vector<UByte>  buf;
+  uint                ret = SUCCESS;
+
+  if (version != v1 && version != v2)
+    ERR("extract: Unsupported image archive version.");
+
+  for (UDWord id : ids) {
+    if (id >= entry_count() || (version == v2 && validate_entry_v2(id))) {
+      std::cerr << "failed retrieving entry: " << id << std::endl;
+      ret = FAIL;
+      continue;
+    }
+
+    File entry;
+    entry.content = nullptr;
+    if (version == v1)
+      get_archive_file_v1(id, &entry);
+    else
+      get_archive_file_v2(id, &entry);
+
+    const char* name     = (version == v1) ? archive_V1[id].filename : archive_V2[id].filename;
+    String      filename = String(name, strnlen(name, 24));
+    if (!valid_file_name(filename)) {
+      std::cerr << "refusing to extract entry " << id << " to the path: "
+                << dest << "/" << filename << std::endl;
+      ret = FAIL;
+      continue;
+    }
+    extents.push_back({filename, entry.offset, entry.size});
+  }
+
+  std::sort(extents.begin(), extents.end(), [](const Extent& x, const Extent& y) {
+    return x.offset < y.offset;
+  });
+
+  for (size_t i = 0; i < extents.size(); i++) {
+    UQWord end = extents[i].offset + extents[i].size;
+
+    if (!runs.empty()) {
+      Run& run = runs.back();
+      if (extents[i].offset <= run.offset + run.size + gap &&
+          end - run.offset <= COALESCE_MAX_RUN) {
+        run.last = i + 1;
+        run.size = std::max(run.size, end - run.offset);
+        continue;
+      }
+    }
+    runs.push_back({i, i + 1, extents[i].offset, extents[i].size});
+  }
+
+  if (!runs.empty())
+    posix_fadvise(img_fd, runs[0].offset, runs[0].size, POSIX_FADV_WILLNEED);
+
+  for (size_t r = 0; r < runs.size(); r++) {
+    Run& run = runs[r];
+
+    if (r + 1 < runs.size())
+      posix_fadvise(img_fd, runs[r+1].offset, runs[r+1].size, POSIX_FADV_WILLNEED);
+
+    buf.resize(run.size);
+    if (pread_full(img_fd, buf.data(), run.size, run.offset)) {
+      std::cerr << img_path << ": Failed reading " << run.size
+                << " bytes at offset: " << run.offset << std::endl;
+      ret = FAIL;
+      continue;
+    }
+
+    for (size_t i = run.first; i < run.last; i++) {
+      String path  = dest + "/" + extents[i].name;
+      FILE*  file  = fopen(path.c_str(), "w");
+      bool   wrote = file != nullptr &&
+                     fwrite(&buf[extents[i].offset - run.offset], sizeof(UByte),
+                            extents[i].size, file) == extents[i].size;
+      if (file != nullptr && fclose(file) != 0)
+        wrote = false;
+      if (!wrote) {
+        std::cerr << "failed writing file: " << path << std::endl;
+        ret = FAIL;
+      }
+    }
+  }
+
+  return ret;
+}
+
 template UDWord IMGArchive::get_file_idx<HeaderV1>(std::vector<HeaderV1>&, const String&);
 template UDWord IMGArchive::get_file_idx<HeaderV2>(std::vector<HeaderV2>&, const String&);
 
@@ -152,30 +327,193 @@ bool IMGArchive::read_from_file(const char* filename, long off, UByte* dst, size
   return 0;
 }
 
+UQWord Replacement::size() {
+  return path.empty() ? data.size() : std::filesystem::file_size(path);
+}
+
+UQWord Replacement::padded_size() {
+  return (size() + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+static inline
+void pad_null_bytes(UByte* arr, UQWord arr_size, UDWord pad_len) {
+  for (UQWord i = arr_size-pad_len; i < arr_size; i++)
+    arr[i] = 0x0;
+}
+
+// Loads the content of `entry` into `file` and pads it with null bytes up to
+// the next sector boundary. `file->size` is set to the padded size.
+bool IMGArchive::load_replacement(Replacement& entry, File* file) {
+  UQWord size     = entry.size();
+  UDWord pad_size = 0;
+  UDWord remainder;
+
+  remainder = size % SECTOR_SIZE;
+  // Pad sufficient futile null-byte sleds to the file and update its size
+  if (remainder)
+    pad_size = SECTOR_SIZE - remainder;
+
+  file->content = new UByte[size + pad_size];
+  pad_null_bytes(file->content, size + pad_size, pad_size);
+  if (entry.path.empty())
+    memcpy(file->content, entry.data.data(), size);
+  else if (read_from_file(entry.path.c_str(), 0, file->content, size))
+    return FAIL;
+  file->size = size + pad_size;
+
+  return SUCCESS;
+}
+
+// Order in which files stored at `from` with `sizes` can be moved to `to`
+// within the image, so that no file is overwritten before it was read: those
+// moving towards the end go last to first, the others first to last, as in
+// memmove. Returns nothing if the files were not stored in order and without
+// overlaps, which this relies on.
+std::vector<UDWord> IMGArchive::move_order(std::vector<UQWord>& from, std::vector<UQWord>& sizes,
+                                           std::vector<UQWord>& to) {
+  std::vector<UDWord> order;
+
+  for (UDWord i = 1; i < from.size(); i++)
+    if (from[i] < from[i-1] + sizes[i-1])
+      return order;
+
+  for (UDWord i = from.size(); i-- > 0;)
+    if (to[i] >= from[i])
+      order.push_back(i);
+  for (UDWord i = 0; i < from.size(); i++)
+    if (to[i] < from[i])
+      order.push_back(i);
+
+  return order;
+}
+
+// Takes the snapshots of the replace in progress right before its first
+// write, so a replace that turns out to change nothing takes none.
+bool IMGArchive::snapshot_before_write() {
+  if (snapshot_tried || snapshot_edits == snapshot_off)
+    return SUCCESS;
+  snapshot_tried = true;
+
+  bool   copy = snapshot_edits == snapshot_copy;
+  String stale;
+
+  img_snapshot.reset(new Snapshot(img_path, copy));
+  if (version == v1 && !img_snapshot->stale())
+    dir_snapshot.reset(new Snapshot(dir_path, copy));
+
+  if (img_snapshot->stale())
+    stale = img_path;
+  else if (dir_snapshot && dir_snapshot->stale())
+    stale = dir_path;
+  bool taken = img_snapshot->taken() && (!dir_snapshot || dir_snapshot->taken());
+
+  // Without reflink support the edit goes ahead without a snapshot.
+  if (!taken) {
+    img_snapshot.reset();
+    dir_snapshot.reset();
+  }
+  if (!stale.empty())
+    ERR(stale + ".snapshot exists, possibly from an earlier edit that failed. "
+        "Restore or remove it before editing " + stale + ".");
+  CHECK((copy && !taken), "Failed taking a snapshot of: " + img_path, FAIL);
+
+  return SUCCESS;
+}
+
+bool IMGArchive::write_sectors(FILE* img, File* file, UQWord first, UQWord last) {
+  if (snapshot_before_write())
+    return FAIL;
+  fseek(img, file->offset + first * SECTOR_SIZE, SEEK_SET);
+  return fwrite(file->content + first * SECTOR_SIZE, SECTOR_SIZE, last - first, img) != last - first;
+}
+
+// Writes `file` at its offset. If it takes the place of a stored file of the
+// same offset and size, the stored sectors are compared first and only runs
+// of differing sectors are written. memcmp is vectorized by the C library.
+bool IMGArchive::write_entry(FILE* img, File* file, UQWord old_offset, UQWord old_size) {
+  UQWord sectors = file->size / SECTOR_SIZE;
+  UQWord first   = 0;
+  bool   dirty   = false;
+
+  sectors_total += sectors;
+
+  if (file->offset != old_offset || file->size != old_size) {
+    sectors_written += sectors;
+    return write_sectors(img, file, 0, sectors);
+  }
+
+  std::vector<UByte> stored(DELTA_CHUNK_SECTORS * SECTOR_SIZE);
+  for (UQWord i = 0; i < sectors; i++) {
+    UQWord slot = i % DELTA_CHUNK_SECTORS;
+
+    if (slot == 0) {
+      UQWord chunk = std::min<UQWord>(sectors - i, DELTA_CHUNK_SECTORS) * SECTOR_SIZE;
+      if (pread_full(img_fd, stored.data(), chunk, file->offset + i * SECTOR_SIZE))
+        return FAIL;
+    }
+
+    bool same = !memcmp(file->content + i * SECTOR_SIZE, &stored[slot * SECTOR_SIZE], SECTOR_SIZE);
+    if (!same && !dirty)
+      first = i;
+    if (same && dirty) {
+      if (write_sectors(img, file, first, i))
+        return FAIL;
+      sectors_written += i - first;
+    }
+    dirty = !same;
+  }
+
+  if (dirty) {
+    if (write_sectors(img, file, first, sectors))
+      return FAIL;
+    sectors_written += sectors - first;
+  }
+
+  return SUCCESS;
+}
+
 uint IMGArchive::replace_archive_files(std::vector<String> old_files, std::vector<String> new_files) {
+  std::vector<Replacement> entries;
 
   if (old_files.size() != new_files.size())
     ERR("The amount of files to be replaced must be equivalent to the "
                  "amount of replacing files.");
 
-  for (String s : new_files) {
-    if (!std::filesystem::exists(s))
-      ERR(s + ": The file to replace an archive file does not exist.");
+  for (UDWord i = 0; i < new_files.size(); i++) {
+    if (!std::filesystem::exists(new_files[i]))
+      ERR(new_files[i] + ": The file to replace an archive file does not exist.");
+
+    Replacement entry;
+    entry.name = old_files[i];
+    entry.path = new_files[i];
+    entries.push_back(entry);
+  }
+
+  return replace_archive_entries(entries);
+}
+
+// Replaces the entries named in `entries`. Names missing from the archive are
+// appended as new entries if `add` is set and are an error otherwise. The
+// content of `entries` is moved out.
+uint IMGArchive::replace_archive_entries(std::vector<Replacement>& entries, bool add) {
+  std::vector<Replacement> replaced;
+  std::vector<Replacement> added;
+
+  std::unique_lock<std::shared_mutex> guard(table_lock);
 
-    if (std::filesystem::file_size(s) > (pow(2, 16) * SECTOR_SIZE))
-      ERR(s + ": The maximum file size may not be larger than 134.21 MB.");
+  for (Replacement& entry : entries) {
+    String source = entry.path.empty() ? entry.name : entry.path;
 
-    if (std::filesystem::file_size(s) < 32)
-      ERR(s + ": The minimum file size must be larger than 32 bytes.");
+    if (entry.size() > MAX_ENTRY_SIZE)
+      ERR(source + ": The maximum file size may not be larger than 134.21 MB.");
+
+    if (entry.size() < 32)
+      ERR(source + ": The minimum file size must be larger than 32 bytes.");
   }
 
   switch (version) {
     case v1:
-      return replace_archive_files_v1(old_files, new_files);
-    break;
-
     case v2:
-      return replace_archive_files_v2(old_files, new_files);
     break;
 
     case v3:
@@ -191,5 +529,49 @@ uint IMGArchive::replace_archive_files(std::vector<String> old_files, std::vecto
     break;
   }
 
-  return SUCCESS;
+  sectors_written = 0;
+  sectors_total   = 0;
+
+  for (Replacement& entry : entries) {
+    UDWord id = (version == v1) ? get_file_idx<HeaderV1>(archive_V1, entry.name)
+                                : get_file_idx<HeaderV2>(archive_V2, entry.name);
+
+    if (add && id == entry_count()) {
+      if (entry.name.size() > 23)
+        ERR(entry.name + ": File names may not be longer than 23 characters.");
+      added.push_back(std::move(entry));
+    }
+    else
+      replaced.push_back(std::move(entry));
+  }
+
+  // Refuse before anything is written if the additions cannot fit.
+  if (version == v2 && !added.empty() && check_header_room_v2(added.size()))
+    return FAIL;
+
+  bool ret = SUCCESS;
+  snapshot_tried = false;
+  if (!replaced.empty())
+    ret = (version == v1) ? replace_archive_files_v1(replaced) : replace_archive_files_v2(replaced);
+  if (ret == SUCCESS && !added.empty())
+    ret = (version == v1) ? add_archive_files_v1(added) : add_archive_files_v2(added);
+
+  if (ret != SUCCESS && img_snapshot) {
+    std::cout << "Rolling back " << img_path << " to its state before the replace." << std::endl;
+    if (img_snapshot->restore() || (dir_snapshot && dir_snapshot->restore())) {
+      img_snapshot.reset();
+      dir_snapshot.reset();
+      return FAIL;
+    }
+
+    // The table may hold headers of the aborted edit, reload it.
+    if (version == v1) archive_V1.clear();
+    else               archive_V2.clear();
+    open_archive();
+  }
+
+  img_snapshot.reset();
+  dir_snapshot.reset();
+
+  return ret;
 }
@@ -130,12 +130,22 @@ read as raw bytes or assigned to a 4-byte sized type.
 #include <algorithm>
 #include <cmath>
 #include <string.h>
+#include <mutex>
+#include <shared_mutex>
+#include <memory>
 
 #define SECTOR_SIZE 2048 // The size of each sector is 2048 bytes
 #define HEADER_SIZE 32   // The size of each header is 32 bytes
 
 #define IMG_HEADER_SIZE_V2 8
 
+#define COALESCE_GAP     (64 * 1024)        // Default gap bridged by batch reads
+#define COALESCE_MAX_RUN (32 * 1024 * 1024) // Largest single batch read
+
+#define DELTA_CHUNK_SECTORS 64 // Sectors compared per read in delta writes
+
+#define MAX_ENTRY_SIZE (65536 * SECTOR_SIZE) // Stream sizes are 16-bit sector counts
+
 typedef uint8_t  UByte;
 typedef uint16_t UWord;
 typedef uint32_t UDWord;
@@ -147,6 +157,12 @@ enum Version {
   vundef, v1, v2, v3
 };
 
+// When to snapshot an image before editing it: never, only if the filesystem
+// can reflink it, or always, falling back to a full copy.
+enum SnapshotMode {
+  snapshot_off, snapshot_reflink, snapshot_copy
+};
+
 struct  HeaderV1 {
   UDWord offset;       // Offset   (in sectors)
   UDWord filesize;     // Size     (in sectors)
@@ -168,6 +184,8 @@ struct HeaderV3 {
   UWord  padding; // Padding size
 };
 
+class Snapshot;
+
 struct File {
   union {
     HeaderV1* headerV1;
@@ -180,6 +198,22 @@ struct File {
   ~File();
 };
 
+// New content for an archive entry, read from `path` or, if `path` is empty,
+// taken from `data`.
+struct Replacement {
+  String             name;
+  String             path;
+  std::vector<UByte> data;
+  UQWord size();
+  UQWord padded_size(); // Size once padded to whole sectors
+};
+
+// Entry reads (get_archive_file, get_entry, copy_file_from_img, num_files) may
+// be called concurrently from any number of threads: they share the table lock
+// and read through one long-lived descriptor with pread, which carries no file
+// position. replace_archive_files/_entries take the table lock exclusively.
+// The header pointer handed out in a File refers into the table and is only
+// valid until the next replace.
 class IMGArchive {
   public:
     IMGArchive(String path, String dir_path = "");
@@ -187,29 +221,70 @@ class IMGArchive {
 
     Version version = vundef;
 
+    // Snapshot the image (and .dir) before replacing files and roll back to
+    // it if the replace fails midway. By default the snapshot is only taken
+    // where it is a reflink, and only once the replace writes something.
+    SnapshotMode snapshot_edits = snapshot_reflink;
+
+    // Sectors written to the image by the last replace, out of the sectors
+    // it covered. Unchanged sectors of a file that keeps its place are not
+    // rewritten.
+    UQWord sectors_written = 0;
+    UQWord sectors_total   = 0;
+
     UDWord num_files();
     File* get_archive_file(UDWord id);
     File* get_archive_file(String filename);
+    bool  get_entry(UDWord id, String& filename, UQWord& offset, UQWord& size);
+    bool  contains(String filename);
     uint  copy_file_from_img(String filename, String dest);
+    uint  copy_files_from_img(std::vector<String> filenames, String dest,
+                              UQWord gap = COALESCE_GAP);
+    uint  copy_files_from_img(std::vector<UDWord> ids, String dest,
+                              UQWord gap = COALESCE_GAP);
     uint  replace_archive_files(std::vector<String> old_file, std::vector<String> new_file);
+    uint  replace_archive_entries(std::vector<Replacement>& entries, bool add = false);
+    uint  export_tar(std::vector<String> filenames, String dest);
+    uint  import_tar(String src);
   private:
     uint open_archive();
+    void use_table(Version v);
+    UDWord entry_count();
+    File* read_archive_file(UDWord id);
     uint open_archive_v1();
     uint open_archive_v2();
     void get_archive_file_v1(UDWord id, File* archive_file);
     void get_archive_file_v2(UDWord id, File* archive_file);
+    bool validate_entry_v2(UDWord id);
     template <typename T>
     static UDWord get_file_idx(std::vector<T>& v, const String& file);
-    bool replace_archive_files_v1(std::vector<String> old_files, std::vector<String> new_files);
-    bool replace_archive_files_v2(std::vector<String> old_files, std::vector<String> new_files);
+    bool replace_archive_files_v1(std::vector<Replacement>& entries);
+    bool replace_archive_files_v2(std::vector<Replacement>& entries);
+    bool add_archive_files_v1(std::vector<Replacement>& entries);
+    bool add_archive_files_v2(std::vector<Replacement>& entries);
+    bool check_header_room_v2(UDWord count);
+    uint copy_entries(std::vector<UDWord>& ids, String& dest, UQWord gap);
+    bool load_replacement(Replacement& entry, File* file);
+    bool snapshot_before_write();
+    bool write_sectors(FILE* img, File* file, UQWord first, UQWord last);
     bool read_from_file(const char* filename, long off, UByte* dst, size_t size);
+    bool write_entry(FILE* img, File* file, UQWord old_offset, UQWord old_size);
+    static std::vector<UDWord> move_order(std::vector<UQWord>& from, std::vector<UQWord>& sizes,
+                                          std::vector<UQWord>& to);
     bool write_to_archive_v1(File* file, UDWord id);
     bool write_to_archive_v2(File* file, UDWord id);
-    FILE*   img;
+    int     img_fd = -1; // Shared read-only descriptor for entry reads
     String  img_path;
     String  dir_path;
+    std::shared_mutex table_lock;
+    // Snapshots of the replace in progress, taken before its first write.
+    std::unique_ptr<Snapshot> img_snapshot;
+    std::unique_ptr<Snapshot> dir_snapshot;
+    bool                      snapshot_tried = false;
+    // Only the table named by `table` is constructed; use_table() switches it.
+    Version table = v1;
     union {
-      std::vector<HeaderV1> archive_V1;
+      std::vector<HeaderV1> archive_V1 = {};
       std::vector<HeaderV2> archive_V2;
       std::vector<HeaderV3> archive_V3;
     };
@@ -1,19 +1,64 @@
 #include "img.hpp"
 #include "utils.hpp"
+#include "batch.hpp"
+#include "watch.hpp"
 
 int main(int argc, char* argv[]) {
   std::vector<String> file_paths;
   std::vector<String> files;
   char* dir = (char*)"";
+  SnapshotMode snapshot = snapshot_reflink;
 
-  if (argc != 4 && argc != 5) {
-    std::cout << "Usage:\n  " << argv[0] << " -e <file> <image> {directory}\n  "
-                              << argv[0] << " -r <file|folder> <image> {directory}" << std::endl;
+  // `-s` snapshots edited images even where that takes a full copy, `-n`
+  // never snapshots them.
+  if (argc >= 2 && (String(argv[1]) == "-s" || String(argv[1]) == "-n")) {
+    snapshot = (String(argv[1]) == "-s") ? snapshot_copy : snapshot_off;
+    argv++;
+    argc--;
+  }
+
+  if (argc >= 4 && String(argv[1]) == "-p") {
+    std::vector<String> images;
+    BatchJob            job;
+
+    if      (String(argv[2]) == "extract") job = job_extract;
+    else if (String(argv[2]) == "verify")  job = job_verify;
+    else if (String(argv[2]) == "hash")    job = job_hash;
+    else
+      ERR("Second argument: " + String(argv[2]) + " must either be `extract`, `verify` or `hash`.");
+
+    // Version 1 images come with a .dir of the same name, accept either one.
+    for (int i = 3; i < argc; i++) {
+      std::filesystem::path path(argv[i]);
+      if (path.extension() == ".dir")
+        path.replace_extension(".img");
+      if (std::find(images.begin(), images.end(), path.string()) == images.end())
+        images.push_back(path.string());
+    }
+
+    return run_batch(job, images, ".");
+  }
+
+  // `-x` and `-t` take a trailing list of entries after the optional directory.
+  bool listed      = argc >= 4 && (String(argv[1]) == "-x" || String(argv[1]) == "-t");
+  int  first_entry = 4;
+
+  if (!listed && argc != 4 && argc != 5) {
+    std::cout << "Usage: " << argv[0] << " [-s|-n] <mode> ...\n  "
+                              << argv[0] << " -e <file> <image> {directory}\n  "
+                              << argv[0] << " -x <folder> <image> {directory} [file...]\n  "
+                              << argv[0] << " -r <file|folder> <image> {directory}\n  "
+                              << argv[0] << " -t <tar|-> <image> {directory} [file...]\n  "
+                              << argv[0] << " -i <tar|-> <image> {directory}\n  "
+                              << argv[0] << " -w <folder> <image> {directory}\n  "
+                              << argv[0] << " -p <extract|verify|hash> <image|directory>..." << std::endl;
     return FAIL;
   }
 
-  if (argc == 5)
-    dir = argv[4];
+  if (argc >= 5 && (!listed || std::filesystem::path(argv[4]).extension() == ".dir")) {
+    dir         = argv[4];
+    first_entry = 5;
+  }
 
   IMGArchive* img_archive  = new IMGArchive(argv[3], dir);
   File*       archive_file = nullptr;
@@ -23,18 +68,33 @@ int main(int argc, char* argv[]) {
     DELETE_PTR(img_archive);
     return 1;
   }
+  img_archive->snapshot_edits = snapshot;
 
   if (String(argv[1]) == "-e") {
     std::filesystem::path path(argv[2]);
     img_archive->copy_file_from_img(path.filename().string(), argv[2]);
   }
+  else if (String(argv[1]) == "-x") {
+    std::vector<UDWord> ids;
+    for (int i = first_entry; i < argc; i++)
+      files.push_back(argv[i]);
+    if (files.empty()) {
+      for (UDWord i = 0; i < img_archive->num_files(); i++)
+        ids.push_back(i);
+    }
+    std::filesystem::create_directories(argv[2]);
+    if (files.empty() ? img_archive->copy_files_from_img(ids, argv[2])
+                      : img_archive->copy_files_from_img(files, argv[2])) {
+      DELETE_PTR(img_archive);
+      return FAIL;
+    }
+  }
   else if (String(argv[1]) == "-r") {
     if (std::filesystem::is_directory(argv[2])) {
       for (const auto& entry : std::filesystem::directory_iterator(argv[2])) {
         if (std::filesystem::is_regular_file(entry)) {
           file_paths.push_back(entry.path().string());
           files.push_back(entry.path().filename().string());
-          img_archive->replace_archive_files(files, file_paths);
         }
       }
     }
@@ -42,11 +102,37 @@ int main(int argc, char* argv[]) {
       std::filesystem::path path(argv[2]);
       file_paths.push_back(argv[2]);
       files.push_back(path.filename().string());
-      img_archive->replace_archive_files(files, file_paths);
+    }
+    if (img_archive->replace_archive_files(files, file_paths) == SUCCESS)
+      std::cout << "Wrote " << img_archive->sectors_written << " of "
+                << img_archive->sectors_total << " sector(s)." << std::endl;
+  }
+  else if (String(argv[1]) == "-t") {
+    for (int i = first_entry; i < argc; i++)
+      files.push_back(argv[i]);
+    if (img_archive->export_tar(files, argv[2])) {
+      DELETE_PTR(img_archive);
+      return FAIL;
+    }
+  }
+  else if (String(argv[1]) == "-i") {
+    if (img_archive->import_tar(argv[2])) {
+      DELETE_PTR(img_archive);
+      return FAIL;
+    }
+    std::cout << "Wrote " << img_archive->sectors_written << " of "
+              << img_archive->sectors_total << " sector(s)." << std::endl;
+  }
+  else if (String(argv[1]) == "-w") {
+    if (!std::filesystem::is_directory(argv[2]))
+      ERR(String(argv[2]) + ": The folder to watch does not exist.");
+    if (watch_folder(img_archive, argv[2])) {
+      DELETE_PTR(img_archive);
+      return FAIL;
     }
   }
   else
-    ERR("First argument: " + String(argv[1]) + " must either be `-e` or `-r`.");
+    ERR("First argument: " + String(argv[1]) + " must either be `-e`, `-x`, `-r`, `-t`, `-i` or `-w`.");
 
   DELETE_PTR(archive_file);
   DELETE_PTR(img_archive);
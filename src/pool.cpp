@@ -0,0 +1,102 @@
+#include "pool.hpp"
+
+// Pool and index of the worker owning the calling thread, unset for outside
+// threads. A worker of one pool is an outside thread to every other pool.
+static thread_local WorkStealingPool* worker_pool = nullptr;
+static thread_local int               worker_id   = -1;
+
+WorkStealingPool::WorkStealingPool(unsigned num_threads) {
+  if (num_threads == 0)
+    num_threads = 1;
+
+  for (unsigned i = 0; i < num_threads; i++)
+    workers.push_back(new Worker);
+  for (unsigned i = 0; i < num_threads; i++)
+    threads.emplace_back(&WorkStealingPool::run, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> guard(idle_lock);
+    stop = true;
+  }
+  idle.notify_all();
+
+  for (std::thread& t : threads)
+    t.join();
+  for (Worker* w : workers)
+    delete w;
+}
+
+void WorkStealingPool::submit(PoolJob task) {
+  // Tasks spawned by a worker stay local to it, everything else is spread
+  // round-robin over the deques.
+  unsigned id = (worker_pool == this) ? worker_id : next++ % workers.size();
+
+  // `queued` is bumped before the push, so a worker taking the task right
+  // away cannot bring it below zero.
+  pending++;
+  {
+    std::lock_guard<std::mutex> guard(idle_lock);
+    queued++;
+  }
+  {
+    std::lock_guard<std::mutex> guard(workers[id]->lock);
+    workers[id]->tasks.push_back(std::move(task));
+  }
+  idle.notify_one();
+}
+
+void WorkStealingPool::wait() {
+  std::unique_lock<std::mutex> guard(idle_lock);
+  done.wait(guard, [this] { return pending == 0; });
+}
+
+bool WorkStealingPool::pop(unsigned id, PoolJob& task) {
+  std::lock_guard<std::mutex> guard(workers[id]->lock);
+  if (workers[id]->tasks.empty())
+    return false;
+  task = std::move(workers[id]->tasks.back());
+  workers[id]->tasks.pop_back();
+  queued--;
+  return true;
+}
+
+bool WorkStealingPool::steal(unsigned id, PoolJob& task) {
+  for (unsigned i = 1; i < workers.size(); i++) {
+    Worker* victim = workers[(id + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim->lock);
+    if (!victim->tasks.empty()) {
+      task = std::move(victim->tasks.front());
+      victim->tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::run(unsigned id) {
+  worker_pool = this;
+  worker_id   = id;
+
+  for (;;) {
+    PoolJob task;
+    if (pop(id, task) || steal(id, task)) {
+      task();
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        done.notify_all();
+      }
+      continue;
+    }
+
+    // `queued` is bumped under idle_lock, so a submit racing the failed steal
+    // above cannot be missed here.
+    std::unique_lock<std::mutex> guard(idle_lock);
+    idle.wait(guard, [this] { return stop || queued > 0; });
+    if (stop && queued == 0)
+      return;
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::function<void()> PoolJob;
+
+// A fixed-size thread pool where every worker owns a task deque. Workers pop
+// their own tasks from the back (LIFO, cache warm) and steal from the front of
+// the other deques (FIFO, largest remaining work) once their own runs dry, so
+// a few oversized tasks do not leave the remaining cores idle.
+class WorkStealingPool {
+  public:
+    WorkStealingPool(unsigned num_threads = std::thread::hardware_concurrency());
+    ~WorkStealingPool();
+
+    unsigned size() const { return workers.size(); }
+    void submit(PoolJob task);
+    void wait();
+  private:
+    struct Worker {
+      std::deque<PoolJob> tasks;
+      std::mutex          lock;
+    };
+
+    void run(unsigned id);
+    bool pop(unsigned id, PoolJob& task);
+    bool steal(unsigned id, PoolJob& task);
+
+    std::vector<Worker*>     workers;
+    std::vector<std::thread> threads;
+    std::mutex               idle_lock;
+    std::condition_variable  idle;
+    std::condition_variable  done;
+    std::atomic<size_t>      pending{0}; // Submitted but not yet finished
+    std::atomic<size_t>      queued{0};  // Sitting in a deque
+    std::atomic<unsigned>    next{0};
+    bool                     stop = false;
+};
+
+#endif
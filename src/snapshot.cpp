@@ -0,0 +1,124 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "snapshot.hpp"
+#include "utils.hpp"
+
+// Copies the allocated ranges of `in` to `out` with copy_file_range, leaving
+// holes as holes.
+static bool sparse_copy(int in, int out) {
+  struct stat st;
+  off_t       data, hole = 0;
+
+  if (fstat(in, &st) || ftruncate(out, 0))
+    return FAIL;
+
+  for (;;) {
+    data = lseek(in, hole, SEEK_DATA);
+    if (data < 0 && errno == ENXIO)
+      break; // No data past `hole`.
+    if (data < 0)
+      return FAIL;
+    hole = lseek(in, data, SEEK_HOLE);
+    if (hole < 0)
+      return FAIL;
+
+    off_t in_off = data, out_off = data;
+    while (in_off < hole) {
+      ssize_t ret = copy_file_range(in, &in_off, out, &out_off, hole - in_off, 0);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return FAIL;
+    }
+  }
+  errno = 0;
+
+  // Restores the size if the file ends in a hole.
+  return ftruncate(out, st.st_size) ? FAIL : SUCCESS;
+}
+
+// Makes `out` an exact copy of `in`, by reflink if possible. Without
+// `allow_copy` only a reflink is tried.
+static bool clone_fd(int in, int out, bool allow_copy) {
+  if (ioctl(out, FICLONE, in) == 0)
+    return SUCCESS;
+
+  errno = 0;
+  return allow_copy ? sparse_copy(in, out) : FAIL;
+}
+
+// Overwrites `dst` with a copy of `src`.
+static bool clone_file(const String& src, const String& dst) {
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  CHECK((in < 0), "failed opening file: " + src, FAIL);
+
+  int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    close(in);
+    CHECK(true, "failed opening file: " + dst, FAIL);
+  }
+
+  bool ret = clone_fd(in, out, true);
+  close(in);
+  if (close(out) != 0)
+    ret = FAIL;
+  CHECK((ret == FAIL), "failed copying " + src + " to " + dst, FAIL);
+
+  return SUCCESS;
+}
+
+// The copy is created exclusively: an existing <path>.snapshot may be all
+// that is left of the file after an earlier edit failed, so it is never
+// overwritten or removed here.
+Snapshot::Snapshot(String file_path, bool allow_copy) {
+  path      = file_path;
+  copy_path = file_path + ".snapshot";
+
+  int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    std::cerr << "failed opening file: " << path << std::endl;
+    return;
+  }
+
+  int out = open(copy_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (out < 0) {
+    stale_copy = errno == EEXIST;
+    if (!stale_copy)
+      std::cerr << "failed opening file: " << copy_path << std::endl;
+    errno = 0;
+    close(in);
+    return;
+  }
+
+  created = true;
+  ok      = clone_fd(in, out, allow_copy) == SUCCESS;
+  close(in);
+  if (close(out) != 0)
+    ok = false;
+  if (!ok && allow_copy)
+    std::cerr << "failed copying " << path << " to " << copy_path << std::endl;
+
+  if (!ok) {
+    unlink(copy_path.c_str());
+    created = false;
+  }
+}
+
+Snapshot::~Snapshot() {
+  if (ok && created)
+    unlink(copy_path.c_str());
+}
+
+uint Snapshot::restore() {
+  CHECK((!ok), "No snapshot to restore " + path + " from.", FAIL);
+  if (clone_file(copy_path, path)) {
+    ok = false; // Keep the copy for manual recovery.
+    ERR("Failed restoring " + path + ", its snapshot is kept at: " + copy_path);
+  }
+
+  return SUCCESS;
+}
@@ -0,0 +1,32 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "img.hpp"
+
+// Point-in-time copy of a file that is about to be edited in place. The copy
+// is a reflink (FICLONE) where the filesystem supports it, which shares all
+// blocks with the original and takes milliseconds regardless of the file size.
+// Elsewhere it falls back to a sparse copy of the allocated ranges, unless
+// `allow_copy` is unset, in which case no snapshot is taken.
+//
+// The copy lives next to the original as <path>.snapshot. restore() writes it
+// back over the original (keeping its inode, so open descriptors see the old
+// content again); the copy is removed once the Snapshot goes out of scope.
+// If <path>.snapshot already exists no snapshot is taken and stale() is set.
+class Snapshot {
+  public:
+    Snapshot(String path, bool allow_copy = true);
+    ~Snapshot();
+
+    bool taken() { return ok; }
+    bool stale() { return stale_copy; }
+    uint restore();
+  private:
+    String path;
+    String copy_path;
+    bool   ok         = false;
+    bool   created    = false; // The copy at copy_path was made by this object
+    bool   stale_copy = false;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "img.hpp"
+#include "utils.hpp"
+
+#define TAR_BLOCK_SIZE  512
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE)
+#define TAR_IMPORT_BATCH (256 * 1024 * 1024) // Member data buffered before it is applied
+
+/*
+Archive entries are exported as a POSIX ustar stream: every entry is preceded
+by a 512-byte header and its data is padded to 512 bytes, followed by two zero
+blocks and padding up to a full 10240-byte record. Entry data is always sector
+(2048 byte) aligned, hence no per-entry padding is ever written.
+
+ustar header (offsets in bytes, numbers are NUL terminated octal strings):
+
+0   - CHAR[100] - File name
+100 - CHAR[8]   - Mode
+108 - CHAR[8]   - Owner ID
+116 - CHAR[8]   - Group ID
+124 - CHAR[12]  - File size
+136 - CHAR[12]  - Modification time
+148 - CHAR[8]   - Header checksum (sum of all header bytes, the field as spaces)
+156 - CHAR      - Type flag ('0' regular file)
+257 - CHAR[6]   - "ustar\0"
+263 - CHAR[2]   - "00"
+*/
+
+static void tar_header(UByte* block, const String& name, UQWord size, time_t mtime) {
+  UDWord sum = 0;
+
+  memset(block, 0, TAR_BLOCK_SIZE);
+  strncpy(reinterpret_cast<char*>(block), name.c_str(), 100);
+  snprintf(reinterpret_cast<char*>(block + 100), 8,  "%07o", 0644);
+  snprintf(reinterpret_cast<char*>(block + 108), 8,  "%07o", 0);
+  snprintf(reinterpret_cast<char*>(block + 116), 8,  "%07o", 0);
+  snprintf(reinterpret_cast<char*>(block + 124), 12, "%011llo", (unsigned long long)size);
+  snprintf(reinterpret_cast<char*>(block + 136), 12, "%011llo", (unsigned long long)mtime);
+  memset(block + 148, ' ', 8);
+  block[156] = '0';
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+
+  for (UDWord i = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += block[i];
+  snprintf(reinterpret_cast<char*>(block + 148), 8, "%06o", sum);
+}
+
+static bool write_all(int fd, const UByte* src, size_t size) {
+  while (size) {
+    ssize_t ret = write(fd, src, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return FAIL;
+    src  += ret;
+    size -= ret;
+  }
+  return SUCCESS;
+}
+
+// Copies `size` bytes at `off` of `in` to `out` inside the kernel. Falls back
+// to a bounce buffer if the descriptors do not support sendfile.
+static bool send_range(int out, int in, off_t off, size_t size) {
+  while (size) {
+    ssize_t ret = sendfile(out, in, &off, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      errno = 0;
+      break;
+    }
+    if (ret <= 0)
+      return FAIL;
+    size -= ret;
+  }
+
+  std::vector<UByte> buf(std::min<size_t>(size, 1 << 20));
+  while (size) {
+    size_t chunk = std::min(size, buf.size());
+    if (pread_full(in, buf.data(), chunk, off) || write_all(out, buf.data(), chunk))
+      return FAIL;
+    off  += chunk;
+    size -= chunk;
+  }
+
+  return SUCCESS;
+}
+
+uint IMGArchive::export_tar(std::vector<String> filenames, String dest) {
+  std::shared_lock<std::shared_mutex> guard(table_lock);
+  std::vector<UDWord> ids;
+  struct stat         st;
+  UByte               block[TAR_BLOCK_SIZE];
+  UQWord              written = 0;
+  bool                failed  = false;
+
+  if (version != v1 && version != v2)
+    ERR("export: Unsupported image archive version.");
+
+  if (filenames.empty()) {
+    for (UDWord i = 0; i < entry_count(); i++)
+      ids.push_back(i);
+  }
+  for (const String& filename : filenames) {
+    UDWord id = (version == v1) ? get_file_idx<HeaderV1>(archive_V1, filename)
+                                : get_file_idx<HeaderV2>(archive_V2, filename);
+    CHECK((id == entry_count()), "Failed to find the file: " + filename +
+          " in the archive: " + img_path, FAIL);
+    ids.push_back(id);
+  }
+
+  int out = (dest == "-") ? STDOUT_FILENO
+                          : open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  CHECK((out < 0), "failed opening file: " + dest, FAIL);
+  fstat(img_fd, &st);
+
+  for (UDWord id : ids) {
+    if (version == v2 && validate_entry_v2(id)) {
+      failed = true;
+      break;
+    }
+
+    File entry;
+    entry.content = nullptr;
+    if (version == v1)
+      get_archive_file_v1(id, &entry);
+    else
+      get_archive_file_v2(id, &entry);
+
+    const char* name = (version == v1) ? entry.headerV1->filename : entry.headerV2->filename;
+    tar_header(block, String(name, strnlen(name, 24)), entry.size, st.st_mtime);
+
+    failed = write_all(out, block, TAR_BLOCK_SIZE) ||
+             send_range(out, img_fd, entry.offset, entry.size);
+    if (failed)
+      break;
+    written += TAR_BLOCK_SIZE + entry.size;
+  }
+
+  // End of archive: two zero blocks, then pad to a whole record.
+  UQWord trailer = 2 * TAR_BLOCK_SIZE;
+  trailer += (TAR_RECORD_SIZE - (written + trailer) % TAR_RECORD_SIZE) % TAR_RECORD_SIZE;
+  memset(block, 0, TAR_BLOCK_SIZE);
+  for (UQWord i = 0; i < trailer && !failed; i += TAR_BLOCK_SIZE)
+    failed = write_all(out, block, TAR_BLOCK_SIZE);
+
+  if (out != STDOUT_FILENO)
+    close(out);
+  CHECK(failed, "failed writing tar stream: " + dest, FAIL);
+
+  return SUCCESS;
+}
+
+// Reads up to `size` bytes, short only at the end of the stream.
+static ssize_t read_full(int fd, UByte* dst, size_t size) {
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t ret = read(fd, dst + done, size - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+      break;
+    done += ret;
+  }
+  return done;
+}
+
+static UQWord tar_number(const UByte* field, size_t len) {
+  UQWord n = 0;
+  size_t i = 0;
+
+  while (i < len && field[i] == ' ')
+    i++;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    n = (n << 3) | (field[i] - '0');
+  return n;
+}
+
+static bool is_zero_block(const UByte* block) {
+  for (UDWord i = 0; i < TAR_BLOCK_SIZE; i++) {
+    if (block[i])
+      return false;
+  }
+  return true;
+}
+
+// Checks the ustar magic (POSIX "ustar\0" or GNU "ustar ") and the checksum,
+// which is computed with the checksum field itself taken as spaces.
+static bool tar_header_valid(const UByte* block) {
+  UQWord sum = 0;
+
+  if (memcmp(block + 257, "ustar", 5))
+    return false;
+
+  for (UDWord i = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += (i >= 148 && i < 156) ? ' ' : block[i];
+  return sum == tar_number(block + 148, 8);
+}
+
+// Reads a ustar stream and applies its regular file members as replacements,
+// adding the ones the archive does not contain yet. Members are matched by
+// their base name, a later member overrides an earlier one of the same name.
+// Members are buffered in memory and applied in batches of up to
+// TAR_IMPORT_BATCH bytes, each one a replace of its own.
+uint IMGArchive::import_tar(String src) {
+  std::vector<Replacement> entries;
+  UByte                    block[TAR_BLOCK_SIZE];
+  std::vector<UByte>       skip(TAR_BLOCK_SIZE);
+  ssize_t                  ret;
+  UQWord                   buffered = 0;
+  UQWord                   written  = 0;
+  UQWord                   total    = 0;
+
+  // Applies the buffered members and sums up the sectors of all batches.
+  auto apply = [&]() -> uint {
+    uint applied = replace_archive_entries(entries, true);
+    written  += sectors_written;
+    total    += sectors_total;
+    buffered  = 0;
+    entries.clear();
+    sectors_written = written;
+    sectors_total   = total;
+    return applied;
+  };
+
+  int in = (src == "-") ? STDIN_FILENO : open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  CHECK((in < 0), "failed opening file: " + src, FAIL);
+
+  for (;;) {
+    ret = read_full(in, block, TAR_BLOCK_SIZE);
+    if (ret == 0 || (ret == TAR_BLOCK_SIZE && is_zero_block(block)))
+      break; // End of archive
+    if (ret != TAR_BLOCK_SIZE || !tar_header_valid(block)) {
+      if (in != STDIN_FILENO)
+        close(in);
+      if (ret < 0)
+        CHECK(true, "failed reading file: " + src, FAIL);
+      ERR(src + ": Not a tar stream, or a truncated or corrupt tar header.");
+    }
+
+    UQWord size    = tar_number(block + 124, 12);
+    UQWord padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    String name    = std::filesystem::path(String(reinterpret_cast<char*>(block),
+                                                  strnlen(reinterpret_cast<char*>(block), 100)))
+                                                  .filename().string();
+
+    if ((block[156] == '0' || block[156] == '\0') && !name.empty()) {
+      if (size > MAX_ENTRY_SIZE) {
+        if (in != STDIN_FILENO)
+          close(in);
+        ERR(name + ": The maximum file size may not be larger than 134.21 MB.");
+      }
+
+      if (!entries.empty() && buffered + size > TAR_IMPORT_BATCH && apply()) {
+        if (in != STDIN_FILENO)
+          close(in);
+        ERR(src + ": Failed applying the members before: " + name);
+      }
+
+      auto it = std::find_if(entries.begin(), entries.end(), [&name](const Replacement& entry) {
+        return entry.name == name;
+      });
+      if (it == entries.end())
+        it = entries.insert(entries.end(), Replacement());
+      buffered -= it->data.size();
+      buffered += size;
+      it->name  = name;
+      it->data.resize(size);
+      if (read_full(in, it->data.data(), size) != (ssize_t)size) {
+        if (in != STDIN_FILENO)
+          close(in);
+        ERR(src + ": Unexpected end of the tar stream in: " + name);
+      }
+      size = padding;
+    }
+    else
+      size += padding; // Directories, links and extended headers are skipped.
+
+    while (size) {
+      UQWord chunk = std::min<UQWord>(size, skip.size());
+      if (read_full(in, skip.data(), chunk) != (ssize_t)chunk)
+        break;
+      size -= chunk;
+    }
+    if (size) {
+      if (in != STDIN_FILENO)
+        close(in);
+      ERR(src + ": Unexpected end of the tar stream in: " + name);
+    }
+  }
+
+  if (in != STDIN_FILENO)
+    close(in);
+  CHECK((ret < 0), "failed reading file: " + src, FAIL);
+
+  return apply();
+}
@@ -0,0 +1,26 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+int pread_full(int fd, void* dst, size_t size, off_t offset) {
+  char* p = static_cast<char*>(dst);
+
+  while (size) {
+    ssize_t ret = pread(fd, p, size, offset);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return FAIL;
+    p      += ret;
+    size   -= ret;
+    offset += ret;
+  }
+
+  return SUCCESS;
+}
+
+bool valid_file_name(const std::string& name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string::npos;
+}
@@ -1,6 +1,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <sys/types.h>
+#include <stddef.h>
+#include <string>
+
 #define SUCCESS 0
 #define FAIL    1
 
@@ -49,7 +53,7 @@
 #define DELETE_CNT(ptr)              \
   if ((ptr != nullptr)) {            \
     if ((ptr->content != nullptr)) { \
-      delete (ptr->content);         \
+      delete[] (ptr->content);       \
       ptr->content = nullptr;        \
     }                                \
   }
@@ -66,6 +70,14 @@
     ptr = nullptr;      \
   }
 
+// Reads exactly `size` bytes at `offset` from `fd`, retrying short reads.
+// Returns SUCCESS or FAIL, never moves the file position.
+int pread_full(int fd, void* dst, size_t size, off_t offset);
+
+// Whether an entry name can be used as a file name inside an output folder:
+// it is not empty, `.` or `..` and holds no `/`, so it cannot point outside.
+bool valid_file_name(const std::string& name);
+
 template<typename T1, typename T2>
 struct Files {
     T1 path;
@@ -0,0 +1,106 @@
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include <chrono>
+#include <set>
+
+#include "watch.hpp"
+#include "utils.hpp"
+
+static volatile sig_atomic_t stop_watching = 0;
+
+static void on_signal(int) {
+  stop_watching = 1;
+}
+
+// Drains all queued inotify events and adds the affected file names to `changed`.
+static bool read_events(int fd, std::set<String>& changed) {
+  alignas(struct inotify_event) char buf[4096];
+
+  for (;;) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EAGAIN) {
+      errno = 0;
+      return SUCCESS;
+    }
+    if (len <= 0)
+      return FAIL;
+
+    for (char* p = buf; p < buf + len;) {
+      struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+      if (event->len && !(event->mask & IN_ISDIR))
+        changed.insert(event->name);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+static void apply_changes(IMGArchive* archive, const String& folder, std::set<String>& changed) {
+  std::vector<String> files;
+  std::vector<String> file_paths;
+
+  for (const String& name : changed) {
+    String path = folder + "/" + name;
+    // Skip editor temporaries and files that vanished again before the apply.
+    if (!archive->contains(name) || !std::filesystem::is_regular_file(path))
+      continue;
+    files.push_back(name);
+    file_paths.push_back(path);
+  }
+  changed.clear();
+
+  if (files.empty())
+    return;
+
+  auto start = std::chrono::steady_clock::now();
+  uint ret   = archive->replace_archive_files(files, file_paths);
+  auto ms    = std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::steady_clock::now() - start).count();
+
+  if (ret == SUCCESS)
+    std::cout << "Replaced " << files.size() << " file(s) in " << ms << " ms, wrote "
+              << archive->sectors_written << " of " << archive->sectors_total
+              << " sector(s)." << std::endl;
+  else
+    std::cout << "Failed replacing " << files.size() << " file(s)." << std::endl;
+}
+
+uint watch_folder(IMGArchive* archive, String folder) {
+  std::set<String> changed;
+  struct sigaction sa = {};
+
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  CHECK((fd < 0), "Failed initializing inotify.", FAIL);
+
+  if (inotify_add_watch(fd, folder.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(fd);
+    CHECK(true, "Failed watching folder: " + folder, FAIL);
+  }
+
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT,  &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  std::cout << "Watching " << folder << " for changes, press Ctrl+C to stop." << std::endl;
+
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (!stop_watching) {
+    // Block until something changes, then keep collecting until it is quiet.
+    int ret = poll(&pfd, 1, changed.empty() ? -1 : WATCH_DEBOUNCE_MS);
+    if (ret < 0 && errno == EINTR) {
+      errno = 0;
+      continue;
+    }
+    if (ret < 0 || (ret > 0 && read_events(fd, changed))) {
+      close(fd);
+      CHECK(true, "Failed reading inotify events for: " + folder, FAIL);
+    }
+    if (ret == 0)
+      apply_changes(archive, folder, changed);
+  }
+
+  close(fd);
+  return SUCCESS;
+}
@@ -0,0 +1,15 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "img.hpp"
+
+#define WATCH_DEBOUNCE_MS 150 // Quiet period before a batch of changes is applied
+
+// Watches `folder` with inotify and replaces the archive entries of files that
+// are written or moved into it. Changes are collected until the folder has
+// been quiet for WATCH_DEBOUNCE_MS, then applied as one replace on the open
+// archive. Files without a matching entry are ignored. Runs until SIGINT or
+// SIGTERM.
+uint watch_folder(IMGArchive* archive, String folder);
+
+#endif